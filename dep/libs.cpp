@@ -33,3 +33,11 @@ static unsigned char * miniz_stbi_compress(unsigned char *data, int data_len, in
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #define STBIR_ASSERT(x) assert(x)
 #include "stb_image_resize.h"
+
+// The C++11 backend needs C++20 semaphores to work; prefer plain pthreads where that's an option
+#if !defined(_WIN32) && !defined(TWS_BACKEND)
+#include <pthread.h>
+#define TWS_BACKEND TWS_BACKEND_PTHREADS
+#endif
+#define TWS_THREAD_IMPLEMENTATION
+#include "tws_thread.h"
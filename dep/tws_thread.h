@@ -605,10 +605,9 @@ TWS_THREAD_EXPORT void tws_sem_acquire(tws_Sem *sem)
 
 TWS_THREAD_EXPORT void tws_sem_release(tws_Sem *sem, unsigned n)
 {
-    sem_post_multiple((sem_t*)sem, n);
-    // If the above is not available:
-    //while(n--)
-    //    sem_post((sem_t*)sem);
+    // sem_post_multiple() is a pthreads-win32 extension, not POSIX
+    while(n--)
+        sem_post((sem_t*)sem);
 }
 
 TWS_THREAD_EXPORT unsigned tws_cpu_count(void)
@@ -1173,6 +1172,18 @@ inline static _tws_IntType tws_atomicAdd_Rel(tws_AtomicInt *x, _tws_IntType v)
 // ----------------------------------------------------------------------
 
 
+/* Spin-wait hint for the lwsem spin loop below */
+#ifndef tws_yieldCPU
+#  if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#    include <intrin.h>
+#    define tws_yieldCPU(n) _mm_pause()
+#  elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#    define tws_yieldCPU(n) __builtin_ia32_pause()
+#  else
+#    define tws_yieldCPU(n) ((void)0)
+#  endif
+#endif
+
 /* Adapted from https://github.com/preshing/cpp11-on-multicore/blob/master/common/sema.h */
 struct tws_LWsemImpl
 {
@@ -0,0 +1,64 @@
+// Counts heap allocations made while loading and packing images,
+// to see what copies along the pipeline cost.
+// Usage: allocbench file.png [file.png ...]
+// Runs on the calling thread only, so the counts don't depend on the machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include "atlas.h"
+
+static unsigned long long s_allocs, s_bytes;
+
+void *operator new(size_t n)
+{
+    ++s_allocs;
+    s_bytes += n;
+    void *p = malloc(n ? n : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n)
+{
+    return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+static void report(const char *what, unsigned long long allocs, unsigned long long bytes)
+{
+    printf("%s: %llu allocations, %llu KB\n", what, allocs, bytes >> 10);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        printf("Usage: %s file.png [file.png ...]\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<std::string> files(argv + 1, argv + argc);
+    Atlas atlas;
+
+    unsigned long long a0 = s_allocs, b0 = s_bytes;
+    size_t loaded = atlas.addFiles(files);
+    report("load", s_allocs - a0, s_bytes - b0);
+
+    a0 = s_allocs; b0 = s_bytes;
+    bool ok = atlas.build();
+    report("build", s_allocs - a0, s_bytes - b0);
+
+    printf("%u/%u files loaded, build %s\n", unsigned(loaded), unsigned(files.size()), ok ? "ok" : "failed");
+    return loaded == files.size() && ok ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <vector>
 #include <algorithm>
+#include <utility>
 #include <assert.h>
 
 class Array2dAny
@@ -28,6 +29,25 @@ public:
     Array2d() : Array2dAny() {}
     Array2d(size_t w, size_t h) : Array2dAny(w, h), _v(w*h) {}
 
+    // Copies are deep; moves take the storage and leave the source empty (0x0), not just with an empty buffer
+    Array2d(const Array2d& o) : Array2dAny(o._w, o._h), _v(o._v) {}
+    Array2d(Array2d&& o) noexcept : Array2dAny(o._w, o._h), _v(std::move(o._v)) { o._w = o._h = 0; }
+    Array2d& operator=(const Array2d& o)
+    {
+        _w = o._w;
+        _h = o._h;
+        _v = o._v; // reuses our buffer if it's big enough
+        return *this;
+    }
+    Array2d& operator=(Array2d&& o) noexcept
+    {
+        _v = std::move(o._v);
+        _w = o._w;
+        _h = o._h;
+        o._w = o._h = 0;
+        o._v.clear();
+        return *this;
+    }
 
     void init(size_t w, size_t h)
     {
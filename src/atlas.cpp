@@ -3,15 +3,56 @@
 #include "mkpoly.h"
 #include "dt2d.h"
 #include "trifill.h"
+#include "threadpool.h"
+#include "fft.h"
+#include "atlasdump.h"
 #include "stb_image_write.h"
+#include <limits>
+#include <iterator>
+#include <chrono>
+#include <math.h>
+#include <string.h>
 
 
+static void clearBox(AABB& box)
+{
+    box.x1 = box.y1 = size_t(-1);
+    box.x2 = box.y2 = 0;
+}
+
+AtlasPage::AtlasPage(uvec2 block)
+    : pixelW(0), pixelH(0), block(block), fragments(0), tracksPixels(false)
+{
+    clearBox(dirty);
+}
+
+void AtlasPage::trackPixels(bool on)
+{
+    assert(!fragments || on == tracksPixels); // the pixels of what's already there would be missing
+    tracksPixels = on;
+    if(on)
+        pixelMask.resize(pixelW, pixelH);
+    else
+        pixelMask.clear();
+}
+
 Atlas::Atlas()
-    : updateDistanceMapInterval(0)
+    : updateDistanceMapInterval(0), threads(NULL), blockSize(4, 4), searchMode(SEARCH_EXHAUSTIVE), fftThreshold(128)
+    , allowRotation(false), allowMirror(false), maxPageSize(0), dedupe(true), fineNudge(false)
+    , dumpInterval(0), portfolio(0), portfolioSeed(0), outlineMetric(DILATE_CHESSBOARD), dumpPolygons(false)
 {
 }
 
-bool Atlas::addFile(const char* fn)
+Atlas::~Atlas()
+{
+    for(size_t i = 0; i < pages.size(); ++i)
+        delete pages[i];
+}
+
+// Load an image and turn it into fragments. Touches nothing but out and outsrc, so this is safe to run on any thread.
+// With dump set, the debug images of making the polygons are written too; they are named after fn,
+// so loading different files at the same time is fine.
+static bool loadFragments(std::vector<AtlasFragment>& out, std::vector<FragmentSource>& outsrc, const char *fn, ThreadPool *threads, uvec2 block, DilationMetric metric, bool dump)
 {
     printf("Loading image '%s'\n", fn);
 
@@ -23,7 +64,15 @@ bool Atlas::addFile(const char* fn)
     }
 
     // Generate polygons enclosing image used areas
-    std::vector<Polygon> polys = mkpoly_twoband(img);
+    std::string debugName;
+    if(dump)
+    {
+        debugName = fn;
+        for(size_t i = 0; i < debugName.size(); ++i)
+            if(debugName[i] == '/' || debugName[i] == '\\' || debugName[i] == ':')
+                debugName[i] = '_';
+    }
+    std::vector<Polygon> polys = mkpoly_twoband(img, threads, metric, dump ? debugName.c_str() : NULL);
     if(polys.empty())
     {
         printf("Failed to generate polygons for image: %s\n", fn);
@@ -32,68 +81,171 @@ bool Atlas::addFile(const char* fn)
 
     for(size_t i = 0; i < polys.size(); ++i)
     {
-        AtlasFragment frag;
+        out.push_back(AtlasFragment());
+        outsrc.push_back(FragmentSource());
+        AtlasFragment& frag = out.back();
+        FragmentSource& src = outsrc.back();
         frag.placed = false;
-        frag.filename = fn;
-        frag.poly = polys[i];
+        frag.shape = 0;
+        frag.page = 0;
+        frag.alias = size_t(-1);
+        src.filename = fn;
+        src.poly = std::move(polys[i]);
 
-        const size_t striplen = genIndexBuffer_Strip(frag.strip, &frag.poly, 1, true);
+        const size_t striplen = genIndexBuffer_Strip(src.strip, &src.poly, 1, true);
         assert(striplen >= 3);
 
-        AABB box = frag.poly.getBoundingRect();
+        AABB box = src.poly.getBoundingRect();
         const size_t w = box.width(), h = box.height();
-        frag.img.init(w, h);
-        frag.img.copy2d(0, 0, img, box.x1, box.y1, w, h);
+        src.img.init(w, h);
+        src.img.copy2d(0, 0, img, box.x1, box.y1, w, h);
 
-        polygonPointsToVertexList(frag.points, ivec2(-box.x1, -box.y1), &frag.poly, 1);
+        polygonPointsToVertexList(src.points, ivec2(-box.x1, -box.y1), &src.poly, 1);
 
-        Process(frag);
-
-        frags.push_back(frag);
+        Atlas::Process(frag, src, block);
     }
     return true;
 }
 
+bool Atlas::addFile(const char* fn)
+{
+    return loadFragments(frags, sources, fn, threads, blockSize, outlineMetric, dumpPolygons);
+}
+
+struct LoadFiles
+{
+    const std::string *fns;
+    ThreadPool *threads; // only used if there's just one file in a batch, otherwise the pool is busy with the files already
+    uvec2 block;
+    DilationMetric metric;
+    bool dump;
+    std::vector<std::vector<AtlasFragment> > results;
+    std::vector<std::vector<FragmentSource> > sources;
+    std::vector<char> ok;
+
+    void operator()(size_t i)
+    {
+        ok[i] = loadFragments(results[i], sources[i], fns[i].c_str(), threads, block, metric, dump);
+    }
+};
+
+size_t Atlas::addFiles(const std::vector<std::string>& fns)
+{
+    // Only a few files per thread are in flight at any time to keep memory use in check.
+    // Fragments are appended in the order of fns, no matter which file finished first.
+    const size_t batch = threads ? threads->size() * 2 : 1;
+    size_t loaded = 0;
+    LoadFiles job;
+    job.threads = threads;
+    job.block = blockSize;
+    job.metric = outlineMetric;
+    job.dump = dumpPolygons;
+    for(size_t i = 0; i < fns.size(); i += batch)
+    {
+        const size_t n = std::min(batch, fns.size() - i);
+        job.fns = &fns[i];
+        job.results.assign(n, std::vector<AtlasFragment>());
+        job.sources.assign(n, std::vector<FragmentSource>());
+        job.ok.assign(n, 0);
+        parallelFor(threads, n, job);
+
+        for(size_t k = 0; k < n; ++k)
+        {
+            loaded += job.ok[k];
+            frags.insert(frags.end(), std::make_move_iterator(job.results[k].begin()), std::make_move_iterator(job.results[k].end()));
+            sources.insert(sources.end(), std::make_move_iterator(job.sources[k].begin()), std::make_move_iterator(job.sources[k].end()));
+        }
+    }
+    return loaded;
+}
+
 
 static void computeDT(Array2d<float> &dist, const Array2d<unsigned char>& solid)
 {
     dt2d_solidToDT(dist.data(), solid.data(), dist.width(), dist.height());
 }
 
-static bool fragmentHighestUsageCmp(const AtlasFragment& a, const AtlasFragment& b)
+// Sorts indices into frags; the fragments themselves never move
+struct HighestUsageFirst
 {
-    //const u32 areaA = a.sz.x * a.sz.y;
-    //const u32 areaB = b.sz.x * b.sz.y;
-    //return areaA > areaB; // FIXME: measurement for "unwieldy" tiles (super long, super high)
-    return a.usedBlocks > b.usedBlocks;
-}
+    const std::vector<AtlasFragment>& frags;
+    HighestUsageFirst(const std::vector<AtlasFragment>& frags) : frags(frags) {}
+    bool operator()(size_t a, size_t b) const
+    {
+        //const u32 areaA = a.sz.x * a.sz.y;
+        //const u32 areaB = b.sz.x * b.sz.y;
+        //return areaA > areaB; // FIXME: measurement for "unwieldy" tiles (super long, super high)
+        return frags[a].usedBlocks > frags[b].usedBlocks;
+    }
+};
 
 
-void Atlas::Process(AtlasFragment& frag)
+// Hash of the alpha channel of img in box after orientation o, which must be one that doesn't swap x and y
+static u64 hashAlpha(const Image2d& img, const AABB& box, unsigned o)
 {
+    const uvec2 sz(unsigned(box.width()), unsigned(box.height()));
+    std::vector<unsigned char> row(sz.x);
+    u64 h = hashBytes(&sz, sizeof(sz));
+    for(unsigned y = 0; y < sz.y; ++y)
+    {
+        for(unsigned x = 0; x < sz.x; ++x)
+        {
+            const uvec2 p = unorientPoint(o, uvec2(x, y), sz);
+            row[x] = img(box.x1 + p.x, box.y1 + p.y).a;
+        }
+        h = hashBytes(&row[0], row.size(), h);
+    }
+    return h;
+}
 
+void Atlas::Process(AtlasFragment& frag, FragmentSource& src, uvec2 block)
+{
+    // The polygon isn't necessarily mirrored along with the image, so the crop may differ by a few transparent pixels.
+    // Look only at what's visible.
+    src.alphaBox = src.img.getAlphaRegion();
+    for(unsigned o = 0; o < ORIENT_COUNT; o += 2)
+        src.alphaHash[o / 2] = src.alphaBox.x1 <= src.alphaBox.x2 ? hashAlpha(src.img, src.alphaBox, o) : 0;
 
-    indexListToTris(frag.tris, &frag.strip[0], frag.strip.size(), TRIMODE_STRIP);
+    {
+        const size_t dims[2] = { src.img.width(), src.img.height() };
+        u64 h = hashBytes(dims, sizeof(dims));
+        h = hashBytes(src.img.data(), src.img.width() * src.img.height() * sizeof(Pixel), h);
+        h = hashBytes(&src.points[0], src.points.size() * sizeof(uvec2), h);
+        src.hash = hashBytes(&src.strip[0], src.strip.size() * sizeof(unsigned), h);
+    }
+
+    src.tris.clear();
+    indexListToTris(src.tris, &src.strip[0], src.strip.size(), TRIMODE_STRIP);
+    frag.size = uvec2(unsigned(src.img.width()), unsigned(src.img.height()));
+    frag.block = block;
+
+    frag.shapes.clear();
+    frag.shapes.push_back(FragmentShape());
+    FragmentShape& base = frag.shapes[0];
+    base.orientation = ORIENT_NORMAL;
+    base.points = src.points;
 
     {
-        const size_t w4 = (frag.img.width() + 3) / 4u;
-        const size_t h4 = (frag.img.height() + 3) / 4u;
-        frag.usage4x4.init(w4, h4);
-        frag.distance4x4.init(w4, h4);
+        const size_t wb = (src.img.width() + block.x - 1) / block.x;
+        const size_t hb = (src.img.height() + block.y - 1) / block.y;
+        base.usageBlocks.init(wb, hb);
+        base.distanceBlocks.init(wb, hb);
 
         Array2d<unsigned char> usageTmp;
-        usageTmp.init(frag.usage4x4.width() * 4, frag.usage4x4.height() * 4);
+        usageTmp.init(base.usageBlocks.width() * block.x, base.usageBlocks.height() * block.y);
         usageTmp.fill(0);
 
-        trifill(usageTmp, &frag.points[0], &frag.tris[0], frag.tris.size());
-        size_t used = downsample4x4(frag.usage4x4, usageTmp);
+        trifill(usageTmp, &src.points[0], &src.tris[0], src.tris.size());
+        size_t used = downsampleBlocks(base.usageBlocks, usageTmp, block.x, block.y);
         frag.usedBlocks = used;
-        size_t total = frag.usage4x4.width() * frag.usage4x4.height();
-        printf("%u/%u (%f %%) of 4x4 blocks are used\n",
-            (unsigned)used, (unsigned)total, 100 * (used / float(total)));
+        base.occupancyBlocks.initFrom(base.usageBlocks);
+        base.pyramid.build(base.occupancyBlocks);
+        size_t total = base.usageBlocks.width() * base.usageBlocks.height();
+        printf("%u/%u (%f %%) of %ux%u blocks are used\n",
+            (unsigned)used, (unsigned)total, 100 * (used / float(total)), block.x, block.y);
 
         /*
-        stbi_write_png("usage4x4.png", frag.usage4x4.width(), frag.usage4x4.height(), 1, frag.usage4x4.data(), 0);
+        stbi_write_png("usageBlocks.png", base.usageBlocks.width(), base.usageBlocks.height(), 1, base.usageBlocks.data(), 0);
         const size_t n = usageTmp.width() * usageTmp.height();
         unsigned char *p = usageTmp.data();
         for(size_t i = 0; i < n; ++i)
@@ -102,51 +254,616 @@ void Atlas::Process(AtlasFragment& frag)
         */
     }
 
-    computeDT(frag.distance4x4, frag.usage4x4);
+    computeDT(base.distanceBlocks, base.usageBlocks);
+
+    // The other orientations are derived from the block map of the first one.
+    // Since the blocks tile the padded image exactly, oriented points stay inside the oriented blocks.
+    const uvec2 psize = frag.paddedSize();
+    for(unsigned o = 1; o < ORIENT_COUNT; ++o)
+    {
+        if((o & 1) && block.x != block.y)
+            continue; // quarter turns would not map blocks onto blocks
+
+        FragmentShape sh;
+        sh.orientation = o;
+        orientArray(sh.usageBlocks, frag.shapes[0].usageBlocks, o);
+        sh.occupancyBlocks.initFrom(sh.usageBlocks);
+
+        // Symmetric shapes would just be tried twice. Only drop a duplicate if the one that is kept
+        // is allowed whenever this one is.
+        bool dup = false;
+        for(size_t i = 0; i < frag.shapes.size() && !dup; ++i)
+        {
+            const unsigned k = frag.shapes[i].orientation;
+            dup = (!(k & ORIENT_ROTATE_MASK) || (o & ORIENT_ROTATE_MASK))
+               && (!(k & ORIENT_MIRROR) || (o & ORIENT_MIRROR))
+               && frag.shapes[i].occupancyBlocks == sh.occupancyBlocks;
+        }
+        if(dup)
+            continue;
+
+        sh.pyramid.build(sh.occupancyBlocks);
+        orientArray(sh.distanceBlocks, frag.shapes[0].distanceBlocks, o);
+        sh.points.resize(src.points.size());
+        for(size_t i = 0; i < src.points.size(); ++i)
+            sh.points[i] = orientPoint(o, src.points[i], psize);
+        frag.shapes.push_back(std::move(sh));
+    }
+}
+
+// The full resolution coverage of every shape, which only fineNudge needs. Made on first use, not when loading.
+void Atlas::_makePixelMasks()
+{
+    for(size_t i = 0; i < frags.size(); ++i)
+    {
+        AtlasFragment& frag = frags[i];
+        const FragmentSource& src = sources[i];
+        if(frag.alias != size_t(-1) || frag.shapes[0].pixelMask.width())
+            continue; // never packed itself, or done already
+
+        const uvec2 psize = frag.paddedSize();
+        Array2d<unsigned char> usageTmp(psize.x, psize.y);
+        usageTmp.fill(0);
+        trifill(usageTmp, &src.points[0], &src.tris[0], src.tris.size());
+        frag.shapes[0].pixelMask.initFrom(usageTmp);
+        for(size_t k = 1; k < frag.shapes.size(); ++k)
+            orientArray(frag.shapes[k].pixelMask, frag.shapes[0].pixelMask, frag.shapes[k].orientation);
+    }
+}
+
+// Built-in fragment orderings for portfolio packing, all biggest first. Index 0 is the default.
+enum FragmentOrdering
+{
+    ORDER_USED_BLOCKS,
+    ORDER_BOX_AREA,
+    ORDER_MAX_SIDE,
+    ORDER_PERIMETER,
+    ORDER_ASPECT, // most unwieldy first
+    ORDER_BUILTIN_COUNT
+};
+
+static inline unsigned xorshift(unsigned& rng)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+struct KeyGreater
+{
+    const std::vector<double>& key;
+    KeyGreater(const std::vector<double>& key) : key(key) {}
+    bool operator()(size_t a, size_t b) const { return key[a] > key[b]; }
+};
+
+// Ordering k of frags. byUsage is the default one, sorted by HighestUsageFirst; it breaks all ties.
+// Orderings past the built-in ones sort by used blocks with random noise of up to 25%.
+static void makeOrdering(std::vector<size_t>& order, const std::vector<AtlasFragment>& frags, const std::vector<size_t>& byUsage, size_t k, unsigned seed)
+{
+    const size_t n = frags.size();
+    std::vector<double> key(n);
+    unsigned rng = (seed ^ unsigned(k * 0x9E3779B9u)) | 1;
+    for(size_t r = 0; r < n; ++r)
+    {
+        const size_t i = byUsage[r];
+        const double w = double(frags[i].size.x), h = double(frags[i].size.y);
+        switch(k)
+        {
+            case ORDER_USED_BLOCKS: key[i] = 0; break; // already in that order
+            case ORDER_BOX_AREA:    key[i] = w * h; break;
+            case ORDER_MAX_SIDE:    key[i] = std::max(w, h); break;
+            case ORDER_PERIMETER:   key[i] = w + h; break;
+            case ORDER_ASPECT:      key[i] = std::max(w, h) / std::max(1.0, std::min(w, h)); break;
+            default:
+                key[i] = double(frags[i].usedBlocks) * (0.75 + 0.5 * (xorshift(rng) / 4294967296.0));
+        }
+    }
+    order = byUsage;
+    std::stable_sort(order.begin(), order.end(), KeyGreater(key));
+}
+
+static size_t pageArea(const Atlas& a);
+static size_t usedArea(const Atlas& a);
+
+// Smaller is better: total page area, then how much of it is actually used
+static bool smallerAtlas(const Atlas& a, const Atlas& b)
+{
+    const size_t areaA = pageArea(a), areaB = pageArea(b);
+    return areaA < areaB || (areaA == areaB && usedArea(a) < usedArea(b));
+}
+
+// Each trial packs the shared fragments into its own atlas, in its own order.
+// Fragments are only read, so trials don't need to synchronize.
+struct PackTrials
+{
+    const std::vector<AtlasFragment>& frags;
+    const std::vector<FragmentSource>& sources;
+    std::vector<Atlas*> atlases;
+    std::vector<std::vector<size_t> > orders;
+    std::vector<std::vector<FragmentPlacement> > placements;
+    std::vector<size_t> failed;
+
+    PackTrials(const std::vector<AtlasFragment>& frags, const std::vector<FragmentSource>& sources) : frags(frags), sources(sources) {}
+    void operator()(size_t i)
+    {
+        failed[i] = atlases[i]->_pack(frags, sources, orders[i], placements[i], false);
+    }
+};
+
+// True if the visible part of b looks exactly like that of a in orientation o
+static bool sameFlipped(const FragmentSource& a, const FragmentSource& b, unsigned o)
+{
+    const uvec2 sz(unsigned(a.alphaBox.width()), unsigned(a.alphaBox.height()));
+    if(a.alphaBox.x1 > a.alphaBox.x2 || orientSize(o, sz) != uvec2(unsigned(b.alphaBox.width()), unsigned(b.alphaBox.height())))
+        return false;
+    for(unsigned y = 0; y < sz.y; ++y)
+        for(unsigned x = 0; x < sz.x; ++x)
+        {
+            const uvec2 p = orientPoint(o, uvec2(x, y), sz);
+            if(memcmp(&a.img(a.alphaBox.x1 + x, a.alphaBox.y1 + y), &b.img(b.alphaBox.x1 + p.x, b.alphaBox.y1 + p.y), sizeof(Pixel)))
+                return false;
+        }
+    return true;
+}
+
+// Give src the mesh of origsrc flipped by o, lined up on the visible pixels, as its alias mesh.
+// Then its triangles map exactly onto orig's in the atlas, and orig's UVs can be reused.
+// Fails if orig's crop would reach past the top or left of src's image.
+static bool aliasFlipped(FragmentSource& src, const FragmentSource& origsrc, unsigned o)
+{
+    const uvec2 sz(unsigned(origsrc.img.width()), unsigned(origsrc.img.height()));
+    const uvec2 c1 = orientPoint(o, uvec2(unsigned(origsrc.alphaBox.x1), unsigned(origsrc.alphaBox.y1)), sz);
+    const uvec2 c2 = orientPoint(o, uvec2(unsigned(origsrc.alphaBox.x2), unsigned(origsrc.alphaBox.y2)), sz);
+    const AABB box = src.poly.getBoundingRect(); // src's crop in its source image
+    const ptrdiff_t ox = ptrdiff_t(box.x1 + src.alphaBox.x1) - std::min(c1.x, c2.x);
+    const ptrdiff_t oy = ptrdiff_t(box.y1 + src.alphaBox.y1) - std::min(c1.y, c2.y);
+    if(ox < 0 || oy < 0)
+        return false;
+
+    src.aliasPoly.points.resize(origsrc.points.size());
+    for(size_t k = 0; k < origsrc.points.size(); ++k)
+    {
+        const uvec2 p = orientPoint(o, origsrc.points[k], sz);
+        src.aliasPoly.points[k].x = p.x + ox;
+        src.aliasPoly.points[k].y = p.y + oy;
+    }
+
+    // Mirroring flips triangle winding. Repeating the first index of each strip shifts its parity, which flips it back.
+    src.aliasStrip.clear();
+    bool start = true;
+    for(size_t k = 0; k < origsrc.strip.size(); ++k)
+    {
+        if(start)
+            src.aliasStrip.push_back(origsrc.strip[k]);
+        src.aliasStrip.push_back(origsrc.strip[k]);
+        start = origsrc.strip[k] == RESTART;
+    }
+    return true;
+}
+
+bool FragmentSource::sameContent(const FragmentSource& o) const
+{
+    return hash == o.hash
+        && img.width() == o.img.width() && img.height() == o.img.height()
+        && points == o.points && strip == o.strip
+        && !memcmp(img.data(), o.img.data(), img.width() * img.height() * sizeof(Pixel));
+}
+
+// Sorts positions in byUsage
+struct HashLess
+{
+    const std::vector<FragmentSource>& sources;
+    const std::vector<size_t>& byUsage;
+    HashLess(const std::vector<FragmentSource>& sources, const std::vector<size_t>& byUsage) : sources(sources), byUsage(byUsage) {}
+    bool operator()(size_t a, size_t b) const
+    {
+        const u64 ha = sources[byUsage[a]].hash, hb = sources[byUsage[b]].hash;
+        return ha < hb || (ha == hb && a < b);
+    }
+};
+
+// Forget what the last build() found, so every fragment is packed on its own again
+void Atlas::_clearAliases()
+{
+    for(size_t i = 0; i < frags.size(); ++i)
+    {
+        frags[i].alias = size_t(-1);
+        sources[i].aliasPoly.points.clear();
+        sources[i].aliasStrip.clear();
+    }
+}
 
+// Point each duplicate or mirrored fragment at the first one in byUsage with the same content, never at another alias.
+// Expects no aliases to be set. Returns the number of those found.
+size_t Atlas::_findAliases(const std::vector<size_t>& byUsage)
+{
+    const size_t n = frags.size();
+    std::vector<size_t> byHash(n); // positions in byUsage
+    for(size_t i = 0; i < n; ++i)
+        byHash[i] = i;
+    std::sort(byHash.begin(), byHash.end(), HashLess(sources, byUsage));
+
+    size_t dups = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        AtlasFragment& frag = frags[byUsage[byHash[i]]];
+        const FragmentSource& src = sources[byUsage[byHash[i]]];
+        // Compare against all earlier ones with the same hash; a collision without equal content is possible, if unlikely
+        for(size_t k = i; k-- > 0 && sources[byUsage[byHash[k]]].hash == src.hash; )
+        {
+            const size_t other = byUsage[byHash[k]];
+            if(frags[other].alias == size_t(-1) && src.sameContent(sources[other]))
+            {
+                frag.alias = other;
+                ++dups;
+                break;
+            }
+        }
+    }
+
+    // Mirrored copies. If frag is other flipped by o, then frag's alpha as is hashes like other's alpha flipped by o.
+    // Only compare pixels if the alpha hashes match; the earlier fragment stays the original.
+    std::vector<std::pair<u64, size_t> > byAlpha; // with positions in byUsage
+    for(size_t r = 0; r < n; ++r)
+        if(frags[byUsage[r]].alias == size_t(-1))
+            byAlpha.push_back(std::make_pair(sources[byUsage[r]].alphaHash[0], r));
+    std::sort(byAlpha.begin(), byAlpha.end());
+
+    static const unsigned flips[] = { ORIENT_MIRROR, ORIENT_MIRROR | 2, 2 };
+    std::vector<unsigned> flippedBy(n, ORIENT_NORMAL);
+    size_t mirrored = 0;
+    for(size_t r = 0; r < n; ++r)
+    {
+        AtlasFragment& frag = frags[byUsage[r]];
+        FragmentSource& src = sources[byUsage[r]];
+        if(frag.alias != size_t(-1))
+            continue;
+        for(size_t f = 0; f < Countof(flips) && frag.alias == size_t(-1); ++f)
+        {
+            const unsigned o = flips[f];
+            const u64 h = src.alphaHash[o / 2];
+            for(size_t k = std::lower_bound(byAlpha.begin(), byAlpha.end(), std::make_pair(h, size_t(0))) - byAlpha.begin();
+                k < byAlpha.size() && byAlpha[k].first == h && byAlpha[k].second < r; ++k)
+            {
+                const size_t other = byUsage[byAlpha[k].second];
+                if(frags[other].alias == size_t(-1) && sameFlipped(sources[other], src, o) && aliasFlipped(src, sources[other], o))
+                {
+                    printf("%s is %s flipped\n", src.filename.c_str(), sources[other].filename.c_str());
+                    frag.alias = other;
+                    flippedBy[byUsage[r]] = o;
+                    ++mirrored;
+                    break;
+                }
+            }
+        }
+    }
+
+    // An exact duplicate of a fragment that became a mirror alias would only find its placement through a chain.
+    // Flip it the same way and point it at the original directly.
+    // If its crop can't be flipped into place, it is packed on its own instead.
+    for(size_t i = 0; i < n; ++i)
+    {
+        const size_t a = frags[i].alias;
+        if(a == size_t(-1) || frags[a].alias == size_t(-1))
+            continue;
+        const size_t orig = frags[a].alias;
+        if(aliasFlipped(sources[i], sources[orig], flippedBy[a]))
+            frags[i].alias = orig;
+        else
+        {
+            frags[i].alias = size_t(-1);
+            --dups;
+        }
+    }
+    return dups + mirrored;
 }
 
 bool Atlas::build()
 {
-    std::sort(frags.begin(), frags.end(), fragmentHighestUsageCmp);
+    // blockSize changed since loading or the last build(): what was made for the old one doesn't fit the new grid
+    for(size_t i = 0; i < frags.size(); ++i)
+        if(!(frags[i].block == blockSize))
+            Process(frags[i], sources[i], blockSize);
+    if(!pages.empty() && !(pages[0]->blockSize() == blockSize))
+    {
+        for(size_t i = 0; i < pages.size(); ++i)
+            delete pages[i];
+        pages.clear();
+    }
+
+    std::vector<size_t> byUsage(frags.size());
+    for(size_t i = 0; i < byUsage.size(); ++i)
+        byUsage[i] = i;
+    std::sort(byUsage.begin(), byUsage.end(), HighestUsageFirst(frags));
 
+    _clearAliases();
+    if(dedupe)
+        if(size_t dups = _findAliases(byUsage))
+            printf("%u duplicate fragments will share a placement\n", (unsigned)dups);
+    if(fineNudge)
+        _makePixelMasks();
 
+    std::vector<size_t> order;
+    std::vector<FragmentPlacement> placements;
+    size_t failed;
+
+    if(portfolio <= 1)
     {
-        size_t maxw = 0, maxh = 0;
-        for(size_t i = 0; i < frags.size(); ++i)
+        makeOrdering(order, frags, byUsage, ORDER_USED_BLOCKS, portfolioSeed);
+        failed = _pack(frags, sources, order, placements, true);
+    }
+    else
+    {
+        PackTrials trials(frags, sources);
+        trials.atlases.resize(portfolio);
+        trials.orders.resize(portfolio);
+        trials.placements.resize(portfolio);
+        trials.failed.resize(portfolio);
+        for(size_t k = 0; k < portfolio; ++k)
         {
-            maxw = std::max(maxw, frags[i].img.width());
-            maxh = std::max(maxh, frags[i].img.height());
+            Atlas *a = _makeTrial();
+            if(!pages.empty())
+                a->resize(pages.back()->width(), pages.back()->height());
+            trials.atlases[k] = a;
+            makeOrdering(trials.orders[k], frags, byUsage, k, portfolioSeed);
         }
-        if(pixels.width() < maxw || pixels.height() < maxh)
-            resize(nextPowerOf2(maxw), nextPowerOf2(maxh));
+        parallelFor(threads, portfolio, trials);
+
+        // Fewest failed fragments wins, then the smallest atlas; ties go to the lower ordering
+        size_t best = 0;
+        for(size_t k = 0; k < portfolio; ++k)
+        {
+            const Atlas& a = *trials.atlases[k];
+            printf("Portfolio ordering %u: %u failed, %u pages, last one %ux%u with %u pixels used\n", (unsigned)k, (unsigned)trials.failed[k],
+                (unsigned)a.numPages(), (unsigned)a.pages.back()->width(), (unsigned)a.pages.back()->height(), (unsigned)a.pages.back()->usedArea());
+            if(trials.failed[k] < trials.failed[best] || (trials.failed[k] == trials.failed[best] && smallerAtlas(a, *trials.atlases[best])))
+                best = k;
+        }
+        printf("Portfolio: using ordering %u\n", (unsigned)best);
+
+        pages.swap(trials.atlases[best]->pages);
+        order.swap(trials.orders[best]);
+        placements.swap(trials.placements[best]);
+        failed = trials.failed[best];
+        for(size_t k = 0; k < portfolio; ++k)
+            delete trials.atlases[k];
     }
 
+    _applyPlacements(order, placements);
 
-    size_t fitted = 0, failed = 0;
-    size_t remainBeforeRecalc = 0;
+    printf("Atlas: %u fitted, %u failed, %u pages\n", (unsigned)(frags.size() - failed), (unsigned)failed, (unsigned)pages.size());
 
+    return !failed;
+}
+
+// Empty atlas with the same settings, to pack frags into without touching this one
+Atlas *Atlas::_makeTrial() const
+{
+    Atlas *a = new Atlas;
+    a->updateDistanceMapInterval = updateDistanceMapInterval;
+    a->threads = threads; // runs serially inside a trial, but whoever else calls this may profit
+    a->blockSize = blockSize;
+    a->searchMode = searchMode;
+    a->fftThreshold = fftThreshold;
+    a->allowRotation = allowRotation;
+    a->allowMirror = allowMirror;
+    a->maxPageSize = maxPageSize;
+    a->fineNudge = fineNudge;
+    return a;
+}
+
+// Store the result of _pack() in frags, and remember the order the fragments were placed in
+void Atlas::_applyPlacements(const std::vector<size_t>& order, const std::vector<FragmentPlacement>& placements)
+{
     for(size_t i = 0; i < frags.size(); ++i)
     {
         AtlasFragment& frag = frags[i];
+        frag.location = placements[i].location;
+        frag.shape = placements[i].shape;
+        frag.page = placements[i].page;
+        frag.placed = placements[i].placed;
+    }
+    placeOrder = order;
+}
+
+static size_t pageArea(const Atlas& a)
+{
+    size_t area = 0;
+    for(size_t p = 0; p < a.numPages(); ++p)
+        area += a.page(p).width() * a.page(p).height();
+    return area;
+}
+
+static size_t usedArea(const Atlas& a)
+{
+    size_t area = 0;
+    for(size_t p = 0; p < a.numPages(); ++p)
+        area += a.page(p).usedArea();
+    return area;
+}
+
+// Ruin and recreate: take a few fragments out of the order and put them back in random places
+static void perturbOrder(std::vector<size_t>& order, unsigned& rng)
+{
+    const size_t n = order.size();
+    const size_t k = 1 + xorshift(rng) % std::max<size_t>(1, n / 8);
+    std::vector<size_t> taken;
+    for(size_t i = 0; i < k; ++i)
+    {
+        const size_t at = xorshift(rng) % order.size();
+        taken.push_back(order[at]);
+        order.erase(order.begin() + at);
+    }
+    for(size_t i = 0; i < taken.size(); ++i)
+        order.insert(order.begin() + xorshift(rng) % (order.size() + 1), taken[i]);
+}
+
+// Negative if the area grew, which happens when a repack fits fragments that didn't fit before
+static long long areaSaved(size_t before, size_t after)
+{
+    return (long long)before - (long long)after;
+}
+
+size_t Atlas::optimize(double maxSeconds, size_t patience)
+{
+    if(frags.empty() || pages.empty() || placeOrder.size() != frags.size() || !(pages[0]->blockSize() == blockSize))
+        return 0; // nothing built yet, or not with this block size
+    if(fineNudge)
+        _makePixelMasks(); // in case it was turned on after build()
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const size_t ncand = threads ? threads->size() : 1;
+    const size_t n = frags.size();
+    size_t bestFailed = 0;
+    for(size_t i = 0; i < n; ++i)
+        bestFailed += !frags[i].placed;
+
+    // Annealing state. placeOrder is always the order of the best packing so far; cur may be a worse one.
+    std::vector<size_t> cur = placeOrder;
+    const size_t startArea = pageArea(*this), startUsed = usedArea(*this);
+    double curCost = double(startArea + startUsed);
+    double temperature = 0.002 * curCost;
+    unsigned rng = (portfolioSeed ^ 0x5EEDu) | 1;
+
+    size_t iter = 0, stale = 0;
+    while(stale < patience && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < maxSeconds)
+    {
+        PackTrials trials(frags, sources);
+        trials.atlases.resize(ncand);
+        trials.orders.assign(ncand, cur);
+        trials.placements.resize(ncand);
+        trials.failed.resize(ncand);
+        for(size_t k = 0; k < ncand; ++k)
+        {
+            trials.atlases[k] = _makeTrial();
+            perturbOrder(trials.orders[k], rng);
+        }
+        parallelFor(threads, ncand, trials);
+
+        size_t c = 0;
+        for(size_t k = 1; k < ncand; ++k)
+            if(trials.failed[k] < trials.failed[c] || (trials.failed[k] == trials.failed[c] && smallerAtlas(*trials.atlases[k], *trials.atlases[c])))
+                c = k;
+        const Atlas& cand = *trials.atlases[c];
+        const double cost = double(pageArea(cand) + usedArea(cand));
+        const size_t oldArea = pageArea(*this), oldUsed = usedArea(*this);
+
+        ++iter;
+        ++stale;
+        if(trials.failed[c] < bestFailed || (trials.failed[c] == bestFailed && smallerAtlas(cand, *this)))
+        {
+            pages.swap(trials.atlases[c]->pages); // old pages are deleted with the trial
+            _applyPlacements(trials.orders[c], trials.placements[c]);
+            bestFailed = trials.failed[c];
+            cur = placeOrder;
+            curCost = cost;
+            stale = 0;
+        }
+        else if(trials.failed[c] == bestFailed && (cost <= curCost || (xorshift(rng) / 4294967296.0) < exp((curCost - cost) / temperature)))
+        {
+            cur.swap(trials.orders[c]); // worse than the best, but keep going from there for a while
+            curCost = cost;
+        }
+        temperature *= 0.95;
+
+        printf("Repack iteration %u: saved %lld pixels of page area (%lld used), %lld pixels total (%lld used)\n", (unsigned)iter,
+            areaSaved(oldArea, pageArea(*this)), areaSaved(oldUsed, usedArea(*this)),
+            areaSaved(startArea, pageArea(*this)), areaSaved(startUsed, usedArea(*this)));
+
+        for(size_t k = 0; k < ncand; ++k)
+            delete trials.atlases[k];
+    }
+
+    const long long saved = areaSaved(startArea, pageArea(*this));
+    printf("Repack: %u iterations, page area %u -> %u (%.2f%% saved), used area %u -> %u\n", (unsigned)iter,
+        (unsigned)startArea, (unsigned)pageArea(*this), 100.0 * saved / startArea, (unsigned)startUsed, (unsigned)usedArea(*this));
+    return saved > 0 ? size_t(saved) : 0;
+}
+
+// Queue the current state of all pages for writing, unless the dumper is busy
+static void queueDump(AtlasDumper& dumper, const std::vector<AtlasPage*>& pages, const std::vector<FragmentPlacement>& placements, size_t step)
+{
+    char buf[128];
+    for(size_t p = 0; p < pages.size(); ++p)
+    {
+        if(dumper.full())
+            continue;
+        if(pages.size() == 1)
+            sprintf(buf, "_atlas/status%05u.png", (unsigned)step);
+        else
+            sprintf(buf, "_atlas/status%05u_%u.png", (unsigned)step, (unsigned)p);
+        AtlasDumpFrame *frame = new AtlasDumpFrame;
+        frame->filename = buf;
+        frame->page = p;
+        pages[p]->snapshot(*frame);
+        frame->placements = placements;
+        dumper.push(frame);
+    }
+}
+
+// Place fragset[order[...]] onto this atlas' pages, results go to placements[fragment index].
+// Doesn't touch frags, so any number of atlases can pack the same fragments at once. Returns the number of fragments that didn't fit.
+size_t Atlas::_pack(const std::vector<AtlasFragment>& fragset, const std::vector<FragmentSource>& sources, const std::vector<size_t>& order, std::vector<FragmentPlacement>& placements, bool dump)
+{
+    placements.assign(fragset.size(), FragmentPlacement());
+
+    // Frames are rendered from fragset and sources, which stay untouched until the dumper is gone
+    AtlasDumper *dumper = dump && dumpInterval ? new AtlasDumper(fragset, sources, 8) : NULL;
+    size_t step = 0;
+
+    if(pages.empty())
+        pages.push_back(new AtlasPage(blockSize));
+    for(size_t p = 0; p < pages.size(); ++p)
+        pages[p]->trackPixels(fineNudge);
+
+    {
+        size_t maxw = 0, maxh = 0;
+        for(size_t i = 0; i < fragset.size(); ++i)
+            if(fragset[i].alias == size_t(-1))
+            {
+                maxw = std::max<size_t>(maxw, fragset[i].size.x);
+                maxh = std::max<size_t>(maxh, fragset[i].size.y);
+            }
+        const size_t lim = maxPageSize ? maxPageSize : size_t(-1);
+        const AtlasPage& page = *pages.back();
+        if(page.width() < maxw || page.height() < maxh)
+            resize(std::min<size_t>(lim, nextPowerOf2(maxw)), std::min<size_t>(lim, nextPowerOf2(maxh)));
+    }
+
+
+    size_t fitted = 0, failed = 0;
+    size_t remainBeforeRecalc = 0;
+
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        const AtlasFragment& frag = fragset[order[i]];
+        if(frag.alias != size_t(-1))
+            continue; // gets its placement below
+        std::vector<ivec2> searched; // per page: no space for frag in this area (in blocks)
 
         while(true)
         {
-            dumpState(i);
+            if(dumper && !(step % dumpInterval))
+                queueDump(*dumper, pages, placements, step);
+            ++step;
+            searched.resize(pages.size(), ivec2(0, 0));
 
-            if(_fitOne(frag, fitted == 0))
+            if(_fitOne(placements[order[i]], frag, sources[order[i]].filename.c_str(), searched))
             {
                 ++fitted;
-                printf("Done. Fitted: %u/%u\n", (unsigned)fitted, (unsigned)frags.size());
+                printf("Done. Fitted: %u/%u\n", (unsigned)fitted, (unsigned)order.size());
                 break;
             }
 
-
+            // Enlarging or starting a new page only adds empty space, so there is no need to look at the old area again
+            for(size_t p = 0; p < pages.size(); ++p)
+                searched[p] = ivec2(int(pages[p]->usageBlocks.width()), int(pages[p]->usageBlocks.height()));
 
             if(!_enlarge())
             {
                 ++failed;
-                printf("Failed to fit tile: %s\n", frag.filename.c_str());
+                printf("Failed to fit tile: %s\n", sources[order[i]].filename.c_str());
                 break;
             }
         }
@@ -156,106 +873,663 @@ bool Atlas::build()
         else
         {
             remainBeforeRecalc = this->updateDistanceMapInterval;
-            updateDT();
+            for(size_t p = 0; p < pages.size(); ++p)
+                pages[p]->updateDT();
         }
     }
 
-    printf("Atlas: %u fitted, %u failed\n", (unsigned)fitted, (unsigned)failed);
+    // A page may have been started for a tile that didn't fit anyway
+    if(pages.size() > 1 && !pages.back()->numFragments())
+    {
+        delete pages.back();
+        pages.pop_back();
+    }
 
-    return !failed;
+    // Duplicates go where their original went; if that one didn't fit, neither do they
+    for(size_t i = 0; i < fragset.size(); ++i)
+        if(fragset[i].alias != size_t(-1))
+        {
+            assert(fragset[fragset[i].alias].alias == size_t(-1)); // no chains, see _findAliases()
+            placements[i] = placements[fragset[i].alias];
+            failed += !placements[i].placed;
+        }
+
+    if(dumper)
+    {
+        dumper->flush();
+        printf("Debug dump: %u images written, %u dropped\n", (unsigned)dumper->written(), (unsigned)dumper->dropped());
+        delete dumper;
+    }
+
+    return failed;
 }
 
-bool Atlas::_fitOne(AtlasFragment& frag, bool first)
+// Candidate scan for _fitOne(), split into bands of rows that can be processed in parallel.
+// Every page and every orientation of the fragment gets its own bands, so all of these are tried in parallel.
+// Each band remembers its own best spot; the best score found by anyone on the same page so far is shared
+// to reject bad spots early. The result is the same as that of a serial scan:
+// The first page with any fit wins. On that page the lowest score wins,
+// ties go to the first orientation, then to the first position in (y, x) order.
+struct FitSearch
 {
-    printf("Fitting %s\n", frag.filename.c_str());
+    struct Part // one per page and orientation
+    {
+        const AtlasPage *page;
+        size_t pageIndex;
+        const FragmentShape *shape;
+        size_t index; // into AtlasFragment::shapes
+        size_t imaxwb, imaxhb, rowsPerBand;
+        size_t skipCols, skipRows; // positions with x < skipCols && y < skipRows are known to collide
+        size_t firstBand;
+    };
+
+    struct Band
+    {
+        size_t part;
+        float score;
+        ivec2 pos;
+        bool found;
+    };
+
+    std::vector<Part> parts;
+    std::vector<Band> bands;
+    std::vector<std::atomic<float> > bounds; // per page: best score of all its bands so far
+    std::atomic<size_t> foundPage; // lowest page that has any fit
+    std::atomic<size_t> perfectBand; // lowest band that found a perfect fit
+
+    // Bands are aligned to the coarsest pyramid level so that each band can do its own pruning
+    static size_t BandRows(size_t imaxhb, size_t nbands)
+    {
+        const size_t S = PyramidCellSize(PYRAMID_LEVELS - 1);
+        const size_t rows = (imaxhb + nbands - 1) / nbands;
+        return ((rows + S - 1) / S) * S;
+    }
 
-    const size_t w4 = frag.usage4x4.width();
-    const size_t h4 = frag.usage4x4.height();
-    const size_t imaxw4 = usage4x4.width() - w4 + 1;
-    const size_t imaxh4 = usage4x4.height() - h4 + 1;
+    FitSearch(size_t npages)
+        : bounds(npages)
+        , foundPage(size_t(-1))
+        , perfectBand(size_t(-1))
+    {
+        for(size_t i = 0; i < npages; ++i)
+            bounds[i] = std::numeric_limits<float>::infinity();
+    }
 
-    ivec2 bestpos(0, 0);
+    // Must be called in page order
+    void addShape(size_t pageIndex, const AtlasPage& page, size_t index, const FragmentShape& shape, size_t nbands, const ivec2& searched)
+    {
+        const size_t awb = page.widthBlocks();
+        const size_t ahb = page.heightBlocks();
+        const size_t wb = shape.usageBlocks.width();
+        const size_t hb = shape.usageBlocks.height();
+        if(wb > awb || hb > ahb)
+            return;
+
+        Part p;
+        p.page = &page;
+        p.pageIndex = pageIndex;
+        p.shape = &shape;
+        p.index = index;
+        p.imaxwb = awb - wb + 1;
+        p.imaxhb = ahb - hb + 1;
+        p.rowsPerBand = BandRows(p.imaxhb, std::min(p.imaxhb, nbands));
+
+        // Anything that lies completely within the area that was already searched collides,
+        // only positions that reach outside of it need checking.
+        p.skipCols = size_t(searched.x) >= wb ? searched.x - wb + 1 : 0;
+        p.skipRows = size_t(searched.y) >= hb ? searched.y - hb + 1 : 0;
+
+        p.firstBand = bands.size();
+        Band band;
+        band.part = parts.size();
+        bands.resize(bands.size() + (p.imaxhb + p.rowsPerBand - 1) / p.rowsPerBand, band);
+        parts.push_back(p);
+    }
+
+    void operator()(size_t b)
+    {
+        Band& band = bands[b];
+        band.found = false;
+        band.score = std::numeric_limits<float>::infinity();
+
+        const Part& p = parts[band.part];
+        if(foundPage.load(std::memory_order_relaxed) < p.pageIndex) // An earlier page wins anyway
+            return;
+
+        const size_t y0 = (b - p.firstBand) * p.rowsPerBand;
+        const size_t yend = std::min(p.imaxhb, y0 + p.rowsPerBand);
+
+        // Figure out which groups of positions can't possibly work, coarsest level first
+        const size_t S0 = PyramidCellSize(0);
+        const size_t top = PYRAMID_LEVELS - 1;
+        const size_t Stop = PyramidCellSize(top);
+        const size_t vw = (p.imaxwb + S0 - 1) / S0;
+        std::vector<char> viable(vw * ((yend - y0 + S0 - 1) / S0), 0);
+        for(size_t by = y0 / Stop; by * Stop < yend; ++by)
+            for(size_t bx = 0; bx * Stop < p.imaxwb; ++bx)
+                markViable(viable, vw, y0 / S0, yend, p, top, bx, by);
+
+        std::atomic<float>& bound = bounds[p.pageIndex];
+        for(size_t iy = y0; iy < yend; ++iy)
+        {
+            // Can't beat an earlier perfect fit or anything on an earlier page
+            if(perfectBand.load(std::memory_order_relaxed) < b || foundPage.load(std::memory_order_relaxed) < p.pageIndex)
+                return;
+
+            const char * const vrow = &viable[((iy - y0) / S0) * vw];
+            for(size_t ix = iy < p.skipRows ? p.skipCols : 0; ix < p.imaxwb; ++ix)
+            {
+                if(!vrow[ix / S0])
+                {
+                    ix |= S0 - 1; // skip to next group
+                    continue;
+                }
+                // Only reject if strictly worse than the shared bound so that ties survive
+                const float curscore = std::min(band.score, bound.load(std::memory_order_relaxed));
+                float score;
+                if(p.page->tryFitAt_Coarse(&score, *p.shape, ix, iy, curscore) && score < band.score)
+                {
+                    band.found = true;
+                    band.score = score;
+                    band.pos = ivec2(ix, iy);
+                    updateMin(bound, score);
+                    updateMin(foundPage, p.pageIndex);
+                    if(!score) // perfect fit?
+                    {
+                        updateMin(perfectBand, b);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    void markViable(std::vector<char>& viable, size_t vw, size_t vy0, size_t yend, const Part& p, size_t level, size_t bx, size_t by) const
+    {
+        const size_t S = PyramidCellSize(level);
+        if(bx * S >= p.imaxwb || by * S >= yend)
+            return;
+        if((bx + 1) * S <= p.skipCols && (by + 1) * S <= p.skipRows) // all known to collide
+            return;
+        if(p.page->isBlocked(*p.shape, level, bx, by))
+            return;
+        if(level)
+        {
+            for(size_t y = 0; y < 4; ++y)
+                for(size_t x = 0; x < 4; ++x)
+                    markViable(viable, vw, vy0, yend, p, level - 1, bx * 4 + x, by * 4 + y);
+        }
+        else
+            viable[(by - vy0) * vw + bx] = 1;
+    }
 
-    if(!first) // First tile goes in the upper left corner, period (otherwise trying to compute the distance transform will end up unhappy)
+    template<typename T>
+    static void updateMin(std::atomic<T>& a, T val)
+    {
+        T cur = a.load(std::memory_order_relaxed);
+        while(val < cur && !a.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {}
+    }
+
+    // Merge in band order so that ties resolve to the first page, orientation, and the lowest (y, x)
+    bool getResult(ivec2& bestpos, size_t& bestshape, size_t& bestpage) const
     {
         bool found = false;
         float bestscore = std::numeric_limits<float>::infinity();
-        for(size_t iy = 0; iy < imaxh4; ++iy)
-            for(size_t ix = 0; ix < imaxw4; ++ix)
+        for(size_t i = 0; i < bands.size(); ++i)
+        {
+            const Part& p = parts[bands[i].part];
+            if(found && p.pageIndex != bestpage)
+                break;
+            if(bands[i].found && bands[i].score < bestscore)
+            {
+                found = true;
+                bestscore = bands[i].score;
+                bestpos = bands[i].pos;
+                bestshape = p.index;
+                bestpage = p.pageIndex;
+            }
+        }
+        return found;
+    }
+};
+
+bool Atlas::_isAllowed(const FragmentShape& shape) const
+{
+    return (allowRotation || !(shape.orientation & ORIENT_ROTATE_MASK))
+        && (allowMirror || !(shape.orientation & ORIENT_MIRROR));
+}
+
+bool Atlas::_searchExhaustive(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag, const std::vector<ivec2>& searched) const
+{
+    // A few bands per thread to even out the load
+    const size_t nbands = threads ? threads->size() * 4 : 1;
+    FitSearch search(pages.size());
+    for(size_t p = 0; p < pages.size(); ++p)
+        if(pages[p]->numFragments()) // empty pages are handled by the caller
+            for(size_t i = 0; i < frag.shapes.size(); ++i)
+                if(_isAllowed(frag.shapes[i]))
+                    search.addShape(p, *pages[p], i, frag.shapes[i], nbands, searched[p]);
+    parallelFor(threads, search.bands.size(), search);
+    return search.getResult(bestpos, bestshape, bestpage);
+}
+
+static bool positionOrder(const ivec2& a, const ivec2& b)
+{
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+bool Atlas::_searchSkyline(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag) const
+{
+    std::vector<ivec2> cand;
+    bool found = false;
+    for(size_t p = 0; p < pages.size() && !found; ++p)
+    {
+        const AtlasPage& page = *pages[p];
+        if(!page.numFragments()) // empty pages are handled by the caller
+            continue;
+
+        float bestscore = std::numeric_limits<float>::infinity();
+        for(size_t k = 0; k < frag.shapes.size(); ++k)
+        {
+            const FragmentShape& shape = frag.shapes[k];
+            if(!_isAllowed(shape))
+                continue;
+
+            cand.clear();
+            page.skyline.candidates(cand, shape.occupancyBlocks, page.usageBlocks.width(), page.usageBlocks.height());
+            std::sort(cand.begin(), cand.end(), positionOrder); // same tie breaking as the exhaustive search
+
+            for(size_t i = 0; i < cand.size(); ++i)
             {
                 float score;
-                if(tryFitAt_Coarse(&score, frag, ix, iy, bestscore) && score < bestscore)
+                if(page.tryFitAt_Coarse(&score, shape, cand[i].x, cand[i].y, bestscore) && score < bestscore)
                 {
                     found = true;
                     bestscore = score;
-                    bestpos = ivec2(ix, iy);
-                    if(!score) // perfect fit?
-                        goto finish;
+                    bestpos = cand[i];
+                    bestshape = k;
+                    bestpage = p;
                 }
             }
-        if(!found)
-            return false; // no spot found
+        }
     }
+    return found;
+}
 
-finish:
+// Spectra of two real signals a and b that were transformed together as a + ib
+static inline void unpackSpectra(cplx& a, cplx& b, const cplx& z, const cplx& zneg)
+{
+    const cplx c = std::conj(zneg);
+    a = (z + c) * 0.5;
+    b = (z - c) * cplx(0, -0.5);
+}
 
-    printf("Fit %s at (%d, %d)\n", frag.filename.c_str(), bestpos.x, bestpos.y);
-    frag.location = bestpos * 4;
-    frag.placed = true;
+// The atlas spectrum has occupancy in the real and distances in the imaginary part,
+// the fragment spectrum has its used blocks in the real part and its footprint in the imaginary part.
+// The inverse transform of the result is the number of colliding blocks (real) and the score (imaginary) at each position.
+struct FFTCombine
+{
+    const cplx *atlas;
+    const cplx *frag;
+    cplx *out;
+    size_t w, h;
 
-    // TODO: finetune-nudge?
+    FFTCombine(const cplx *atlas, const cplx *frag, cplx *out, size_t w, size_t h)
+        : atlas(atlas), frag(frag), out(out), w(w), h(h) {}
 
-    // add in
-    tridraw(pixels, bestpos * 4, &frag.points[0], &frag.tris[0], frag.tris.size(), frag.img);
+    void operator()(size_t y)
+    {
+        const size_t ny = (h - y) & (h - 1);
+        for(size_t x = 0; x < w; ++x)
+        {
+            const size_t nx = (w - x) & (w - 1);
+            cplx occ, dist, used, box;
+            unpackSpectra(occ, dist, atlas[y * w + x], atlas[ny * w + nx]);
+            unpackSpectra(used, box, frag[y * w + x], frag[ny * w + nx]);
+            out[y * w + x] = occ * std::conj(used) + cplx(0, 1) * dist * std::conj(box);
+        }
+    }
+};
 
-    // update usage map so that now occupied blocks are marked as such
-    for(size_t y = 0; y < h4; ++y)
-        for(size_t x = 0; x < w4; ++x)
-            usage4x4(bestpos.x + x, bestpos.y + y) += frag.usage4x4(x, y);
+bool Atlas::_searchFFT(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag) const
+{
+    for(size_t p = 0; p < pages.size(); ++p)
+    {
+        const AtlasPage& page = *pages[p];
+        if(!page.numFragments()) // empty pages are handled by the caller
+            continue;
+
+        // Correlation is circular, but fragment blocks never wrap around for positions where the fragment fits,
+        // so there is no need for extra padding
+        const size_t awb = page.widthBlocks();
+        const size_t ahb = page.heightBlocks();
+        const size_t w = nextPowerOf2(unsigned(awb));
+        const size_t h = nextPowerOf2(unsigned(ahb));
+        const FFT fx(w), fy(h);
+        const double scale = 1.0 / double(w * h);
+
+        std::vector<cplx> A(w * h), F(w * h), R(w * h);
+        for(size_t y = 0; y < ahb; ++y)
+            for(size_t x = 0; x < awb; ++x)
+                A[y * w + x] = cplx(page.occupancyBlocks.get(x, y) ? 1 : 0, page.distanceBlocks(x, y));
+        fft2d(&A[0], fx, fy, false, threads);
+
+        bool found = false;
+        float bestscore = std::numeric_limits<float>::infinity();
+        for(size_t k = 0; k < frag.shapes.size(); ++k)
+        {
+            const FragmentShape& shape = frag.shapes[k];
+            const size_t fwb = shape.usageBlocks.width();
+            const size_t fhb = shape.usageBlocks.height();
+            if(!_isAllowed(shape) || fwb > awb || fhb > ahb)
+                continue;
+
+            std::fill(F.begin(), F.end(), cplx(0, 0));
+            for(size_t y = 0; y < fhb; ++y)
+                for(size_t x = 0; x < fwb; ++x)
+                    F[y * w + x] = cplx(shape.occupancyBlocks.get(x, y) ? 1 : 0, 1);
+            fft2d(&F[0], fx, fy, false, threads);
+
+            FFTCombine comb(&A[0], &F[0], &R[0], w, h);
+            parallelFor(threads, h, comb);
+            fft2d(&R[0], fx, fy, true, threads);
+
+            const size_t imaxwb = awb - fwb + 1;
+            const size_t imaxhb = ahb - fhb + 1;
+            double lo = std::numeric_limits<double>::infinity();
+            for(size_t y = 0; y < imaxhb; ++y)
+                for(size_t x = 0; x < imaxwb; ++x)
+                {
+                    const cplx r = R[y * w + x] * scale;
+                    if(r.real() < 0.5) // collision counts are integers
+                        lo = std::min(lo, r.imag());
+                }
+            if(lo == std::numeric_limits<double>::infinity())
+                continue; // no collision-free position
+
+            // The FFT scores are a tiny bit off from the float sums of tryFitAt_Coarse().
+            // Rescore everything that could be the minimum the exact same way as the exhaustive search
+            // so that both modes always pick the same spot.
+            const double tol = lo * double(fwb * fhb) * 2.5e-7 + 1e-5;
+            for(size_t y = 0; y < imaxhb; ++y)
+                for(size_t x = 0; x < imaxwb; ++x)
+                {
+                    const cplx r = R[y * w + x] * scale;
+                    float score;
+                    if(r.real() < 0.5 && r.imag() <= lo + tol
+                        && page.tryFitAt_Coarse(&score, shape, x, y, bestscore) && score < bestscore)
+                    {
+                        found = true;
+                        bestscore = score;
+                        bestpos = ivec2(int(x), int(y));
+                        bestshape = k;
+                        bestpage = p;
+                    }
+                }
+        }
+        if(found)
+            return true;
+    }
+    return false;
+}
+
+// The exhaustive search costs about (positions * fragment area), the FFT search (atlas area * log(atlas area)).
+// Positions and atlas area are about the same, so it comes down to fragment area vs. log(atlas area).
+bool Atlas::_preferFFT(const AtlasFragment& frag) const
+{
+    const AtlasPage& page = *pages.back();
+    const size_t fwb = frag.shapes[0].usageBlocks.width();
+    const size_t fhb = frag.shapes[0].usageBlocks.height();
+    const double n = double(nextPowerOf2(unsigned(page.usageBlocks.width()))) * nextPowerOf2(unsigned(page.usageBlocks.height()));
+    return double(fwb * fhb) > fftThreshold * log(n) / log(2.0);
+}
 
+bool Atlas::_fitOne(FragmentPlacement& where, const AtlasFragment& frag, const char *name, const std::vector<ivec2>& searched)
+{
+    printf("Fitting %s\n", name);
+
+    ivec2 bestpos(0, 0);
+    size_t bestshape = 0, bestpage = 0;
+
+    SearchMode mode = searchMode;
+    if(mode == SEARCH_AUTO)
+        mode = _preferFFT(frag) ? SEARCH_FFT : SEARCH_EXHAUSTIVE;
+
+    bool found;
+    switch(mode)
+    {
+        case SEARCH_SKYLINE:
+            found = _searchSkyline(bestpos, bestshape, bestpage, frag);
+            break;
+        case SEARCH_FFT:
+            found = _searchFFT(bestpos, bestshape, bestpage, frag);
+            break;
+        default:
+            found = _searchExhaustive(bestpos, bestshape, bestpage, frag, searched);
+    }
+    if(!found)
+    {
+        // Only the last page can be empty. First tile on a page goes in the upper left corner, period
+        // (otherwise trying to compute the distance transform will end up unhappy)
+        const AtlasPage& last = *pages.back();
+        const FragmentShape& shape = frag.shapes[0];
+        if(last.numFragments() || shape.usageBlocks.width() > last.usageBlocks.width() || shape.usageBlocks.height() > last.usageBlocks.height())
+            return false; // no spot found
+        bestpage = pages.size() - 1;
+    }
+
+    const FragmentShape& shape = frag.shapes[bestshape];
+    printf("Fit %s at (%d, %d) on page %u, orientation %u\n", name, bestpos.x, bestpos.y, (unsigned)bestpage, shape.orientation);
+    const uvec2 block = pages[bestpage]->blockSize();
+    where.location = ivec2(bestpos.x * block.x, bestpos.y * block.y);
+    where.shape = bestshape;
+    where.page = bestpage;
+    where.placed = true;
+
+    if(fineNudge)
+        where.location = pages[bestpage]->nudge(shape, bestpos);
+
+    pages[bestpage]->add(shape, where.location);
     return true;
 }
 
+// Number of mask pixels per block when mask is put at pixel offset (ox, oy) into a grid of blocks of size block, ox < block.x, oy < block.y
+static void blockFootprint(Array2d<unsigned char>& out, const BitArray2d& mask, uvec2 block, size_t ox, size_t oy)
+{
+    const size_t mw = mask.width(), mh = mask.height();
+    out.init((ox + mw + block.x - 1) / block.x, (oy + mh + block.y - 1) / block.y);
+    for(size_t by = 0; by < out.height(); ++by)
+    {
+        const size_t y0 = by ? by * block.y - oy : 0;
+        const size_t y1 = std::min(mh, (by + 1) * block.y - oy);
+        for(size_t bx = 0; bx < out.width(); ++bx)
+        {
+            const size_t x0 = bx ? bx * block.x - ox : 0;
+            const size_t x1 = std::min(mw, (bx + 1) * block.x - ox);
+            const u64 m = BitArray2d::lowmask(x1 - x0);
+            unsigned n = 0;
+            for(size_t y = y0; y < y1; ++y)
+                n += BitArray2d::popcount(BitArray2d::extract(mask.row(y), x0) & m);
+            out(bx, by) = (unsigned char)n;
+        }
+    }
+}
+
+// Pixel-exact test of mask at pixel position (x, y). Returns false on collision,
+// otherwise the number of mask pixels that touch placed pixels or the top/left page edge.
+// (The right and bottom edges don't count, that's where the page might still grow.)
+bool AtlasPage::contactAt(size_t *pcontact, const BitArray2d& mask, size_t x, size_t y) const
+{
+    const size_t n = mask.words();
+    size_t contact = 0;
+    for(size_t my = 0; my < mask.height(); ++my)
+    {
+        const size_t py = y + my;
+        const u64 *here = pixelMask.row(py);
+        const u64 *above = py ? pixelMask.row(py - 1) : NULL;
+        const u64 *below = py + 1 < pixelMask.height() ? pixelMask.row(py + 1) : NULL;
+        const u64 *mrow = mask.row(my);
+        for(size_t k = 0; k < n; ++k)
+        {
+            const u64 f = mrow[k];
+            if(!f)
+                continue;
+            const size_t px = x + k * 64;
+            const u64 a = BitArray2d::extract(here, px);
+            if(f & a)
+                return false;
+            u64 touch = above ? BitArray2d::extract(above, px) : ~u64(0);
+            if(below)
+                touch |= BitArray2d::extract(below, px);
+            touch |= px ? BitArray2d::extract(here, px - 1) : (a << 1) | 1;
+            touch |= BitArray2d::extract(here, px + 1);
+            contact += BitArray2d::popcount(f & touch);
+        }
+    }
+    *pcontact = contact;
+    return true;
+}
+
+// Blocks in fp, placed at block position (bx, by), that are not used yet
+size_t AtlasPage::newBlocks(const Array2d<unsigned char>& fp, size_t bx, size_t by) const
+{
+    size_t n = 0;
+    for(size_t y = 0; y < fp.height(); ++y)
+        for(size_t x = 0; x < fp.width(); ++x)
+            n += fp(x, y) && !occupancyBlocks.get(bx + x, by + y);
+    return n;
+}
+
+ivec2 AtlasPage::nudge(const FragmentShape& shape, ivec2 blockpos) const
+{
+    assert(tracksPixels && shape.pixelMask.width());
+    const BitArray2d& mask = shape.pixelMask;
+    const int bw = int(block.x), bh = int(block.y);
+    const int x0 = blockpos.x * bw, y0 = blockpos.y * bh;
+    const int maxx = int(widthBlocks() * bw - mask.width());
+    const int maxy = int(heightBlocks() * bh - mask.height());
+
+    // The coarse spot is collision-free and all its blocks are new
+    ivec2 best(x0, y0);
+    size_t bestcontact;
+    contactAt(&bestcontact, mask, x0, y0);
+    const size_t coarseBlocks = newBlocks(shape.usageBlocks, blockpos.x, blockpos.y);
+    size_t bestblocks = coarseBlocks;
+
+    Array2d<unsigned char> fp;
+    for(int dy = 1 - bh; dy < bh; ++dy)
+        for(int dx = 1 - bw; dx < bw; ++dx)
+        {
+            const int x = x0 + dx, y = y0 + dy;
+            if((!dx && !dy) || x < 0 || y < 0 || x > maxx || y > maxy)
+                continue;
+
+            size_t contact;
+            if(!contactAt(&contact, mask, x, y) || contact < bestcontact)
+                continue;
+
+            // Must not take more blocks than the coarse spot, otherwise the coarse packing gets worse
+            blockFootprint(fp, mask, block, x % bw, y % bh);
+            const size_t nb = newBlocks(fp, x / bw, y / bh);
+            if(nb > coarseBlocks)
+                continue;
+
+            // Most contact, then fewest new blocks; on a tie the earlier offset wins
+            if(contact > bestcontact || nb < bestblocks)
+            {
+                best = ivec2(x, y);
+                bestcontact = contact;
+                bestblocks = nb;
+            }
+        }
+    return best;
+}
+
+void AtlasPage::add(const FragmentShape& shape, ivec2 loc)
+{
+    if(tracksPixels)
+        pixelMask.blitOr(shape.pixelMask, loc.x, loc.y);
+
+    // Off the block grid, the pixels may end up in different blocks than the shape's
+    const ivec2 pos(loc.x / int(block.x), loc.y / int(block.y));
+    const Array2d<unsigned char> *usage = &shape.usageBlocks;
+    const BitArray2d *occupancy = &shape.occupancyBlocks;
+    Array2d<unsigned char> fp;
+    BitArray2d fpOccupancy;
+    if(loc.x % block.x || loc.y % block.y)
+    {
+        blockFootprint(fp, shape.pixelMask, block, loc.x % block.x, loc.y % block.y);
+        fpOccupancy.initFrom(fp);
+        usage = &fp;
+        occupancy = &fpOccupancy;
+    }
+    const size_t wb = usage->width();
+    const size_t hb = usage->height();
+
+    // update usage map so that now occupied blocks are marked as such
+    for(size_t y = 0; y < hb; ++y)
+        for(size_t x = 0; x < wb; ++x)
+            usageBlocks(pos.x + x, pos.y + y) += (*usage)(x, y);
+    occupancyBlocks.blitOr(*occupancy, pos.x, pos.y);
+    pyramid.update(occupancyBlocks, pos.x, pos.y, wb, hb);
+    skyline.update(*occupancy, pos.x, pos.y);
+
+    // remember what needs a distance map update
+    dirty.x1 = std::min<size_t>(dirty.x1, pos.x);
+    dirty.y1 = std::min<size_t>(dirty.y1, pos.y);
+    dirty.x2 = std::max<size_t>(dirty.x2, pos.x + wb - 1);
+    dirty.y2 = std::max<size_t>(dirty.y2, pos.y + hb - 1);
+
+    ++fragments;
+}
+
 void Atlas::resize(size_t w, size_t h)
 {
-    printf("Resize atlas to (%u x %u)\n", (unsigned)w, (unsigned)h);
-    pixels.resize(w, h);
+    if(pages.empty())
+        pages.push_back(new AtlasPage(blockSize));
+    pages.back()->resize(w, h);
+}
 
-    const size_t w4 = (w + 3) / 4u;
-    const size_t h4 = (h + 3) / 4u;
-    usage4x4.resize(w4, h4);
-    distance4x4.init(w4, h4);
-    updateDT();
+void AtlasPage::resize(size_t w, size_t h)
+{
+    printf("Resize atlas page to (%u x %u)\n", (unsigned)w, (unsigned)h);
+    pixelW = w;
+    pixelH = h;
+
+    // Only whole blocks, so that nothing placed can reach past the edge
+    const size_t wb = w / block.x;
+    const size_t hb = h / block.y;
+    usageBlocks.resize(wb, hb);
+    if(tracksPixels)
+        pixelMask.resize(w, h);
+    occupancyBlocks.resize(wb, hb);
+    pyramid.build(occupancyBlocks);
+    skyline.build(occupancyBlocks);
+    distanceBlocks.init(wb, hb);
+
+    // Size change affects all distances, recompute everything
+    dt2d_solidToDT(dtstate, distanceBlocks.data(), usageBlocks.data(), wb, hb);
+    clearBox(dirty);
 }
 
-bool Atlas::tryFitAt_Coarse(float *pscore, const AtlasFragment& frag, size_t xo, size_t yo, float curscore) const
+bool AtlasPage::tryFitAt_Coarse(float *pscore, const FragmentShape& shape, size_t xo, size_t yo, float curscore) const
 {
-    const size_t fw = frag.usage4x4.width();
-    const size_t fh = frag.usage4x4.height();
-    const size_t aw = usage4x4.width();
-    const size_t ah = usage4x4.height();
+    const size_t fw = shape.usageBlocks.width();
+    const size_t fh = shape.usageBlocks.height();
+    const size_t aw = usageBlocks.width();
+    const size_t ah = usageBlocks.height();
     if(xo + fw > aw || yo + fh > ah)
         return false;
 
     float score = 0;
     for(size_t y = 0; y < fh; ++y)
     {
-        const unsigned char * const pa =      usage4x4   .row(y + yo) + xo;
-        const float *         const sa =      distance4x4.row(y + yo) + xo;
-        const unsigned char * const pf = frag.   usage4x4.row(y);
-        const float *         const sf = frag.distance4x4.row(y);
+        if(occupancyBlocks.rowIntersects(shape.occupancyBlocks, y, xo, yo)) // Any block set in both? Collision, done here
+            return false;
 
+        // Penalize unfilled blocks
+        const float * const sa = distanceBlocks.row(y + yo) + xo;
         for(size_t x = 0; x < fw; ++x)
-            if(pa[x] && pf[x]) // Both set? Collision, done here
-                return false;
-            else //if(pa[x] || pf[x])
-            {
-                // Penalize unfilled blocks
-                //if(!pa[x] && !pf[x])
-                    score += sa[x];
-                //if(!pf[x])
-                //    score += sf[x];
-            }
+            score += sa[x];
 
         // Only check this occasionally, no need to do this on every block
         if(score > curscore) // Won't fit any better
@@ -266,52 +1540,175 @@ bool Atlas::tryFitAt_Coarse(float *pscore, const AtlasFragment& frag, size_t xo,
     return true;
 }
 
+bool AtlasPage::isBlocked(const FragmentShape& shape, size_t level, size_t bx, size_t by) const
+{
+    return pyramid.blocked(shape.pyramid, level, bx, by);
+}
+
 bool Atlas::_enlarge()
 {
-    if(pixels.width() < pixels.height())
-        resize(pixels.width() * 2, pixels.height());
+    AtlasPage& page = *pages.back();
+    const size_t w = page.width(), h = page.height();
+    const size_t lim = maxPageSize ? maxPageSize : size_t(-1);
+
+    if(w < lim && (w < h || h >= lim))
+        page.resize(std::min(w * 2, lim), h);
+    else if(h < lim)
+        page.resize(w, std::min(h * 2, lim));
+    else if(!page.numFragments())
+        return false; // didn't fit on a whole empty page, another one won't help
     else
-        resize(pixels.width(), pixels.height() * 2);
+    {
+        printf("Starting atlas page %u\n", (unsigned)pages.size());
+        pages.push_back(new AtlasPage(blockSize));
+        pages.back()->trackPixels(fineNudge);
+        pages.back()->resize(lim, lim);
+    }
 
     return true;
 }
 
-void Atlas::updateDT()
+void AtlasPage::snapshot(AtlasDumpFrame& frame) const
+{
+    frame.width = width();
+    frame.height = height();
+    frame.block = block;
+    frame.usageBlocks = usageBlocks;
+    frame.distanceBlocks = distanceBlocks;
+}
+
+size_t AtlasPage::usedArea() const
+{
+    size_t maxx = 0, maxy = 0;
+    for(size_t y = 0; y < usageBlocks.height(); ++y)
+        for(size_t x = 0; x < usageBlocks.width(); ++x)
+            if(usageBlocks(x, y))
+            {
+                maxx = std::max(maxx, x + 1);
+                maxy = y + 1;
+            }
+    return maxx * block.x * maxy * block.y;
+}
+
+void AtlasPage::updateDT()
 {
-    computeDT(distance4x4, usage4x4);
+    if(dirty.x1 > dirty.x2)
+        return; // nothing changed since last time
+
+    dt2d_addSolid(dtstate, distanceBlocks.data(), usageBlocks.data(), dirty.x1, dirty.y1, dirty.width(), dirty.height());
+    clearBox(dirty);
 }
 
-void Atlas::renderCurrentState(Image2d& out)
+// Pixels are only drawn once everything is placed. The page is split into tiles that are drawn in parallel,
+// each from the fragments that overlap it.
+#define COMPOSE_TILE_SIZE 256
+
+struct ComposeTiles
+{
+    Image2d& out;
+    const std::vector<AtlasFragment>& frags;
+    const std::vector<FragmentSource>& sources;
+    std::vector<std::vector<size_t> > bins; // per tile: indices of the fragments that overlap it
+    size_t tilesX;
+
+    ComposeTiles(Image2d& out, const std::vector<AtlasFragment>& frags, const std::vector<FragmentSource>& sources)
+        : out(out), frags(frags), sources(sources), tilesX(0) {}
+    void operator()(size_t t)
+    {
+        const size_t x = (t % tilesX) * COMPOSE_TILE_SIZE, y = (t / tilesX) * COMPOSE_TILE_SIZE;
+        const AABB clip = { x, y, std::min<size_t>(out.width(), x + COMPOSE_TILE_SIZE) - 1, std::min<size_t>(out.height(), y + COMPOSE_TILE_SIZE) - 1 };
+        const std::vector<size_t>& bin = bins[t];
+        for(size_t i = 0; i < bin.size(); ++i)
+        {
+            const AtlasFragment& frag = frags[bin[i]];
+            const FragmentSource& src = sources[bin[i]];
+            const FragmentShape& shape = frag.placedShape();
+            tridraw(out, clip, frag.location, &shape.points[0], &src.tris[0], src.tris.size(), src.img, shape.orientation, frag.paddedSize());
+        }
+    }
+};
+
+void Atlas::composePage(Image2d& out, size_t pageIndex) const
 {
-    out.init(pixels.width(), pixels.height());
+    const AtlasPage& page = *pages[pageIndex];
+    const Pixel clear = { 0, 0, 0, 0 };
+    out.init(page.width(), page.height());
+    out.fill(clear);
 
-    const size_t w4 = usage4x4.width();
-    const size_t h4 = usage4x4.height();
+    ComposeTiles job(out, frags, sources);
+    job.tilesX = (page.width() + COMPOSE_TILE_SIZE - 1) / COMPOSE_TILE_SIZE;
+    const size_t tilesY = (page.height() + COMPOSE_TILE_SIZE - 1) / COMPOSE_TILE_SIZE;
+    job.bins.resize(job.tilesX * tilesY);
+
+    for(size_t i = 0; i < frags.size(); ++i)
+    {
+        const AtlasFragment& frag = frags[i];
+        if(!frag.placed || frag.page != pageIndex || frag.alias != size_t(-1))
+            continue;
+
+        const uvec2 sz = orientSize(frag.placedShape().orientation, frag.paddedSize());
+        const size_t x = size_t(frag.location.x), y = size_t(frag.location.y);
+        const size_t tx1 = x / COMPOSE_TILE_SIZE, ty1 = y / COMPOSE_TILE_SIZE;
+        const size_t tx2 = std::min<size_t>(job.tilesX - 1, (x + sz.x - 1) / COMPOSE_TILE_SIZE);
+        const size_t ty2 = std::min<size_t>(tilesY - 1, (y + sz.y - 1) / COMPOSE_TILE_SIZE);
+        for(size_t ty = ty1; ty <= ty2; ++ty)
+            for(size_t tx = tx1; tx <= tx2; ++tx)
+                job.bins[ty * job.tilesX + tx].push_back(i);
+    }
+
+    parallelFor(threads, job.bins.size(), job);
+}
+
+void Atlas::renderCurrentState(Image2d& out, size_t pageIndex)
+{
+    const AtlasPage& page = *pages[pageIndex];
+    std::vector<FragmentPlacement> placements(frags.size());
+    for(size_t i = 0; i < frags.size(); ++i)
+    {
+        const AtlasFragment& frag = frags[i];
+        placements[i].location = frag.location;
+        placements[i].shape = frag.shape;
+        placements[i].page = frag.page;
+        placements[i].placed = frag.placed;
+    }
+    RenderPage(out, page.width(), page.height(), page.block, page.usageBlocks, page.distanceBlocks, pageIndex, frags, sources, placements);
+}
+
+void Atlas::RenderPage(Image2d& out, size_t w, size_t h, uvec2 block, const Array2d<unsigned char>& usageBlocks, const Array2d<float>& distanceBlocks,
+    size_t pageIndex, const std::vector<AtlasFragment>& fragset, const std::vector<FragmentSource>& sources, const std::vector<FragmentPlacement>& placements)
+{
+    out.init(w, h);
+
+    const size_t wb = usageBlocks.width();
+    const size_t hb = usageBlocks.height();
 
     Pixel pix;
     pix.a = 0xff;
 
     // distance grid
-    for(size_t by = 0; by < h4; ++by)
-        for(size_t bx = 0; bx < w4; ++bx)
+    for(size_t by = 0; by < hb; ++by)
+        for(size_t bx = 0; bx < wb; ++bx)
         {
-            float d = distance4x4(bx, by) * 256 * 2;
+            float d = distanceBlocks(bx, by) * 256 * 2;
             pix.r = pix.g = pix.b = std::min((int)d, 0xff);
-            for(size_t y = 0; y < 4; ++y)
-                for(size_t x = 0; x < 4; ++x)
-                    out(bx*4+x, by*4+y) = pix;
+            for(size_t y = 0; y < block.y; ++y)
+                for(size_t x = 0; x < block.x; ++x)
+                    out(bx*block.x+x, by*block.y+y) = pix;
 
 
         }
 
     // pixel data
-    for(size_t i = 0; i < frags.size(); ++i)
+    for(size_t i = 0; i < fragset.size(); ++i)
     {
-        AtlasFragment& frag = frags[i];
-        if(!frag.placed)
+        const AtlasFragment& frag = fragset[i];
+        const FragmentPlacement& where = placements[i];
+        if(!where.placed || where.page != pageIndex || frag.alias != size_t(-1))
             continue;
 
-        tridraw(out, frag.location, &frag.points[0], &frag.tris[0], frag.tris.size(), frag.img);
+        const FragmentShape& shape = frag.shapes[where.shape];
+        const FragmentSource& src = sources[i];
+        tridraw(out, where.location, &shape.points[0], &src.tris[0], src.tris.size(), src.img, shape.orientation, frag.paddedSize());
     }
 
 
@@ -319,26 +1716,29 @@ void Atlas::renderCurrentState(Image2d& out)
     pix.r = 0;
     pix.g = 0xff;
     pix.b = 0;
-    for(size_t by = 0; by < h4; ++by)
-        for(size_t bx = 0; bx < w4; ++bx)
-            if(usage4x4(bx, by))
+    for(size_t by = 0; by < hb; ++by)
+        for(size_t bx = 0; bx < wb; ++bx)
+            if(usageBlocks(bx, by))
             {
-                out(bx*4, by*4) = pix;
-                out(bx*4+1, by*4) = pix;
-                out(bx*4, by*4+1) = pix;
+                out(bx*block.x, by*block.y) = pix;
+                if(block.x > 1)
+                    out(bx*block.x+1, by*block.y) = pix;
+                if(block.y > 1)
+                    out(bx*block.x, by*block.y+1) = pix;
             }
 
 
     pix.r = 0xff;
     pix.g = 0;
     pix.b = 0;
-    for(size_t i = 0; i < frags.size(); ++i)
+    for(size_t i = 0; i < fragset.size(); ++i)
     {
-        AtlasFragment& frag = frags[i];
-        if(!frag.placed)
+        const AtlasFragment& frag = fragset[i];
+        const FragmentPlacement& where = placements[i];
+        if(!where.placed || where.page != pageIndex || frag.alias != size_t(-1))
             continue;
 
-        triwireframe(out, frag.location, &frag.points[0], &frag.tris[0], frag.tris.size(), pix);
+        triwireframe(out, where.location, &frag.shapes[where.shape].points[0], &sources[i].tris[0], sources[i].tris.size(), pix);
     }
 }
 
@@ -346,23 +1746,34 @@ void Atlas::renderCurrentState(Image2d& out)
 void Atlas::dumpState(size_t i)
 {
     Image2d dbg;
-    renderCurrentState(dbg);
     char buf[128];
-    //sprintf(buf, "_atlas/status%05u__%ux%u.png", (unsigned)i, (unsigned)pixels.width(), (unsigned)pixels.height());
-    sprintf(buf, "_atlas/status%05u.png", (unsigned)i);
-    dbg.writePNG(buf);
+    for(size_t p = 0; p < pages.size(); ++p)
+    {
+        renderCurrentState(dbg, p);
+        //sprintf(buf, "_atlas/status%05u__%ux%u.png", (unsigned)i, (unsigned)pixels.width(), (unsigned)pixels.height());
+        if(pages.size() == 1)
+            sprintf(buf, "_atlas/status%05u.png", (unsigned)i);
+        else
+            sprintf(buf, "_atlas/status%05u_%u.png", (unsigned)i, (unsigned)p);
+        dbg.writePNG(buf);
+    }
 }
 
 size_t Atlas::exportVerticesU(std::vector<uvec2>& dst)
 {
     const size_t oldsize = dst.size();
-    for(size_t i = 0; i < frags.size(); ++i)
+    for(size_t k = 0; k < placeOrder.size(); ++k)
     {
-        AtlasFragment& frag = frags[i];
+        const AtlasFragment& frag = frags[placeOrder[k]];
         if(!frag.placed)
             continue;
 
-        dst.insert(dst.end(), frag.points.begin(), frag.points.end());
+        // Same vertex order as FragmentSource::points, but where they ended up in the atlas. Aliases share their original's.
+        const AtlasFragment& packed = frag.alias != size_t(-1) ? frags[frag.alias] : frag;
+        const std::vector<uvec2>& points = packed.shapes[frag.shape].points;
+        const uvec2 loc(frag.location);
+        for(size_t k = 0; k < points.size(); ++k)
+            dst.push_back(points[k] + loc);
     }
     return dst.size() - oldsize;
 }
@@ -370,45 +1781,65 @@ size_t Atlas::exportVerticesU(std::vector<uvec2>& dst)
 size_t Atlas::exportVerticesF(std::vector<vec2>& dst)
 {
     std::vector<uvec2> tmp;
+    std::vector<unsigned> tmppages;
     const size_t N = exportVerticesU(tmp);
+    exportPageIndices(tmppages);
     dst.reserve(dst.size() + N);
 
-    // Double precision because this is an offline preprocessing step where as little precision loss as possible is good
-    const double dw = double(pixels.width());
-    const double dh = double(pixels.height());
-    const dvec2 halfPixel(0.5 / dw, 0.5 / dh);
-    const dvec2 dsize(dw, dh);
     for(size_t i = 0; i < N; ++i)
     {
+        // Double precision because this is an offline preprocessing step where as little precision loss as possible is good
+        const AtlasPage& page = *pages[tmppages[i]];
+        const double dw = double(page.width());
+        const double dh = double(page.height());
+        const dvec2 halfPixel(0.5 / dw, 0.5 / dh);
+        const dvec2 dsize(dw, dh);
         vec2 dv = vec2((dvec2(tmp[i]) / dsize) + halfPixel);
         dst.push_back(dv);
     }
     return N;
 }
 
+size_t Atlas::exportPageIndices(std::vector<unsigned>& dst)
+{
+    const size_t oldsize = dst.size();
+    for(size_t k = 0; k < placeOrder.size(); ++k)
+    {
+        const AtlasFragment& frag = frags[placeOrder[k]];
+        if(!frag.placed)
+            continue;
+
+        const size_t mesh = frag.alias != size_t(-1) ? frag.alias : placeOrder[k];
+        dst.insert(dst.end(), sources[mesh].points.size(), unsigned(frag.page));
+    }
+    return dst.size() - oldsize;
+}
+
 size_t Atlas::exportIndices(std::vector<unsigned>& dst, bool keepRestart)
 {
     const size_t oldsize = dst.size();
     const bool degenerate = !keepRestart;
     size_t offset = 0;
 
-    for(size_t i = 0; i < frags.size(); ++i)
+    for(size_t i = 0; i < placeOrder.size(); ++i)
     {
-        AtlasFragment& frag = frags[i];
+        const AtlasFragment& frag = frags[placeOrder[i]];
         if(!frag.placed)
             continue;
+        const std::vector<unsigned>& strip = sources[placeOrder[i]].exportStrip();
+        const size_t numPoints = sources[frag.alias != size_t(-1) ? frag.alias : placeOrder[i]].points.size();
 
-        const size_t N = frag.strip.size();
+        const size_t N = strip.size();
         unsigned prev = 0;
         for(size_t k = 0; k < N; ++k)
         {
-            unsigned idx = frag.strip[k];
+            unsigned idx = strip[k];
             if(idx == RESTART)
             {
                 if(degenerate)
                 {
                     dst.push_back(prev + offset);
-                    dst.push_back(frag.strip[k+1] + offset);
+                    dst.push_back(strip[k+1] + offset);
                 }
                 else
                 {
@@ -422,7 +1853,7 @@ size_t Atlas::exportIndices(std::vector<unsigned>& dst, bool keepRestart)
             }
         }
 
-        offset += frag.points.size();
+        offset += numPoints;
     }
     return dst.size() - oldsize;
 }
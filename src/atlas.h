@@ -2,8 +2,42 @@
 
 #include "polygon.h"
 #include "image2d.h"
+#include "bitarray2d.h"
+#include "occupancy.h"
+#include "dt2d.h"
+#include "orient.h"
+#include "mkpoly.h"
 
-struct AtlasFragment
+class ThreadPool;
+struct AtlasDumpFrame;
+
+// Placement data of a fragment in one orientation
+struct FragmentShape
+{
+    unsigned orientation; // see orient.h
+    std::vector<uvec2> points; // AtlasFragment::points in this orientation
+
+    Array2d<unsigned char> usageBlocks; // for debugging; placement uses occupancyBlocks
+    BitArray2d occupancyBlocks;
+    FragmentPyramid pyramid;
+    Array2d<float> distanceBlocks;
+    BitArray2d pixelMask; // full resolution coverage, padded to whole blocks; only made when packing with Atlas::fineNudge
+};
+
+// Where a fragment went while packing; copied into AtlasFragment once packing is done
+struct FragmentPlacement
+{
+    ivec2 location;
+    size_t shape;
+    size_t page;
+    bool placed;
+
+    FragmentPlacement() : location(0, 0), shape(0), page(0), placed(false) {}
+};
+
+// Everything about a fragment that packing never looks at: pixels, mesh, and what's needed to find duplicates.
+// Only read to compose and export the atlas, and it never moves once loaded.
+struct FragmentSource
 {
     Image2d img;
     Polygon poly;
@@ -12,40 +46,156 @@ struct AtlasFragment
     std::vector<uvec2> points;
     std::vector<Tri> tris;
 
+    std::string filename;
+    u64 hash; // of pixels and polygon, to find duplicates
+    AABB alphaBox; // around all pixels of img that aren't fully transparent; empty (x1 > x2) if there are none
+    u64 alphaHash[4]; // of the alpha channel in alphaBox after orientation 0, 2, 4, 6 (as is, flipped both ways, flipped in x, flipped in y), to find mirrored copies
+
+    // Only set while this is a mirrored alias (see Atlas::build()): the original's mesh flipped onto this image, lined up on the visible pixels.
+    // Exported instead of poly and strip; everything above stays as loaded, so building again or without dedupe starts from scratch.
+    Polygon aliasPoly;
+    std::vector<unsigned> aliasStrip;
 
-    Array2d<unsigned char> usage4x4;
-    Array2d<float> distance4x4;
+    bool sameContent(const FragmentSource& o) const;
+    const std::vector<unsigned>& exportStrip() const { return aliasStrip.empty() ? strip : aliasStrip; }
+};
+
+// What packing works with. The pixels and mesh are in the FragmentSource with the same index.
+struct AtlasFragment
+{
+    std::vector<FragmentShape> shapes; // [0] is as loaded, followed by all other orientations that differ in block usage
     size_t usedBlocks;
-    std::string filename;
+    uvec2 size; // of the source image, in pixels
     ivec2 location;
+    size_t shape; // index into shapes; valid when placed
+    size_t page; // valid when placed
     bool placed;
+    size_t alias; // index of an identical or mirrored fragment that gets packed instead of this one, or size_t(-1). Its shapes and UVs are used for this one.
+    uvec2 block; // placement grid block size in pixels that shapes were made for
+
+    const FragmentShape& placedShape() const { return shapes[shape]; }
+    uvec2 paddedSize() const { return uvec2(unsigned(shapes[0].usageBlocks.width() * block.x), unsigned(shapes[0].usageBlocks.height() * block.y)); }
+};
+
+// One texture of the atlas and everything needed to place more fragments on it
+class AtlasPage
+{
+    friend class Atlas;
+
+public:
+    AtlasPage(uvec2 block);
+    void resize(size_t w, size_t h);
+    bool tryFitAt_Coarse(float *pscore, const FragmentShape& shape, size_t xo, size_t yo, float curscore) const;
+    bool isBlocked(const FragmentShape& shape, size_t level, size_t bx, size_t by) const; // see AtlasPyramid::blocked()
+    void add(const FragmentShape& shape, ivec2 loc); // loc in pixels. Only marks the space as used, see Atlas::composePage()
+    ivec2 nudge(const FragmentShape& shape, ivec2 blockpos) const; // best pixel position around a coarse spot
+    void updateDT();
+    void trackPixels(bool on); // keep pixelMask, which nudge() needs. Set before adding anything.
+
+    size_t width() const { return pixelW; }
+    size_t height() const { return pixelH; }
+    size_t widthBlocks() const { return usageBlocks.width(); }
+    size_t heightBlocks() const { return usageBlocks.height(); }
+    uvec2 blockSize() const { return block; }
+    size_t numFragments() const { return fragments; }
+    size_t usedArea() const; // in pixels, of the bounding box of everything placed
+    void snapshot(AtlasDumpFrame& frame) const; // for debug output
+
+private:
+    bool contactAt(size_t *pcontact, const BitArray2d& mask, size_t x, size_t y) const;
+    size_t newBlocks(const Array2d<unsigned char>& fp, size_t bx, size_t by) const;
+
+    size_t pixelW, pixelH;
+    uvec2 block;
+    Array2d<unsigned char> usageBlocks;
+    BitArray2d occupancyBlocks; // 1 bit per used block, for collision tests
+    AtlasPyramid pyramid;
+    Skyline skyline;
+    Array2d<float> distanceBlocks;
+    DT2dState dtstate;
+    AABB dirty; // blocks changed since the last distance map update, in blocks
+    BitArray2d pixelMask; // 1 bit per used pixel, only used to refine placement; empty unless tracksPixels
+    size_t fragments;
+    bool tracksPixels;
 };
 
 class Atlas
 {
 public:
+    enum SearchMode
+    {
+        SEARCH_EXHAUSTIVE, // try every position; slowest but packs densest
+        SEARCH_SKYLINE,    // only try positions resting on the skyline of what's placed so far
+        SEARCH_FFT,        // same result as SEARCH_EXHAUSTIVE, but scores all positions at once via FFT; faster for large fragments
+        SEARCH_AUTO,       // SEARCH_FFT or SEARCH_EXHAUSTIVE, depending on fragment size
+    };
+
     Atlas();
+    ~Atlas();
     bool addFile(const char *fn);
-    static void Process(AtlasFragment &frag);
+    size_t addFiles(const std::vector<std::string>& fns); // like addFile(), but on the thread pool. Returns how many loaded.
+    static void Process(AtlasFragment& frag, FragmentSource& src, uvec2 block);
 
     bool build();
-    void resize(size_t w, size_t h);
-    bool tryFitAt_Coarse(float *pscore, const AtlasFragment& frag, size_t xo, size_t yo, float curscore) const;
-    void renderCurrentState(Image2d& out);
-    void dumpState(size_t i);
+    size_t optimize(double maxSeconds, size_t patience = 20); // after build(): repack to make the atlas smaller until out of time or patience (iterations without improvement). Returns page area saved, in pixels; 0 if fitting more fragments made it bigger.
+    void resize(size_t w, size_t h); // resizes the last page
+    size_t numPages() const { return pages.size(); }
+    const AtlasPage& page(size_t i) const { return *pages[i]; }
+    size_t numFragments() const { return frags.size(); }
+    const AtlasFragment& fragment(size_t i) const { return frags[i]; } // in the order they were added
+    const FragmentSource& source(size_t i) const { return sources[i]; }
+    void composePage(Image2d& out, size_t page) const; // the final texture, after build()
+    void renderCurrentState(Image2d& out, size_t page = 0); // for debugging
+    static void RenderPage(Image2d& out, size_t w, size_t h, uvec2 block, const Array2d<unsigned char>& usageBlocks, const Array2d<float>& distanceBlocks,
+        size_t page, const std::vector<AtlasFragment>& fragset, const std::vector<FragmentSource>& sources, const std::vector<FragmentPlacement>& placements);
+    void dumpState(size_t i); // write all pages to _atlas/ right now
     size_t exportVerticesU(std::vector<uvec2> &dst);
-    size_t exportVerticesF(std::vector<vec2> &dst);
+    size_t exportVerticesF(std::vector<vec2> &dst); // normalized to the size of each fragment's page
+    size_t exportPageIndices(std::vector<unsigned> &dst); // one per vertex, same order as exportVerticesU()
     size_t exportIndices(std::vector<unsigned> &dst, bool keepRestart);
 
-    size_t updateDistanceMapInterval;
+    size_t updateDistanceMapInterval; // skip this many distance map updates after placing a fragment. Updates are incremental, so this is rarely useful.
+    ThreadPool *threads; // optional, NULL to do everything on the calling thread
+    // Placement grid block size in pixels, 4x4 by default. Fragments are always placed on block boundaries, so this should match
+    // the block size of the texture compression format (4x4 for BCn/ETC2, e.g. 6x6 for ASTC). Small blocks pack tighter, big ones pack faster.
+    // Fragments are prepared for it when loading; if it changed since, build() prepares them again and starts on empty pages.
+    uvec2 blockSize;
+    SearchMode searchMode;
+    // SEARCH_AUTO uses SEARCH_FFT for fragments with more than this many blocks per log2(page blocks).
+    // Timed single-threaded on a few hundred fragments: up to ~120 the exhaustive search always won,
+    // from ~190 up the FFT won most fits. 128 sits in that gap; tune it if your machine or data differ.
+    size_t fftThreshold;
+    bool allowRotation; // try fragments rotated by 90, 180, 270 degrees
+    bool allowMirror; // try fragments mirrored; the renderer must not rely on triangle winding then
+    size_t maxPageSize; // pages grow up to this in each direction, then a new page of this size is started. 0 for no limit.
+    bool dedupe; // identical fragments (same pixels and polygon) and exact mirrors are packed only once and share their placement
+    bool fineNudge; // shift fragments by up to a block less a pixel after placing them, to make them touch their neighbors. Breaks block alignment.
+    size_t dumpInterval; // while building, write the state to _atlas/ every this many steps, on a background thread. 0 to turn off.
+    size_t portfolio; // pack with this many fragment orderings in parallel and keep the smallest result. 0 or 1 for just the default ordering.
+    unsigned portfolioSeed; // orderings past the built-in ones and optimize() are random, but the same seed gives the same result
+    DilationMetric outlineMetric; // how fragment outlines keep their distance from the pixels when loading, see mkpoly.h
+    bool dumpPolygons; // when loading, write the intermediate images of making each fragment's polygons (see mkpoly_twoband()). Slow.
 
 private:
-    bool _enlarge();
-    bool _fitOne(AtlasFragment& frag, bool first);
-    std::vector<AtlasFragment> frags;
+    friend struct PackTrials;
+    Atlas(const Atlas&);
+    Atlas& operator=(const Atlas&);
 
-    Image2d pixels;
-    Array2d<unsigned char> usage4x4;
-    Array2d<float> distance4x4;
-    void updateDT();
+    Atlas *_makeTrial() const;
+    void _makePixelMasks();
+    void _clearAliases();
+    size_t _findAliases(const std::vector<size_t>& byUsage);
+    void _applyPlacements(const std::vector<size_t>& order, const std::vector<FragmentPlacement>& placements);
+    size_t _pack(const std::vector<AtlasFragment>& fragset, const std::vector<FragmentSource>& sources, const std::vector<size_t>& order, std::vector<FragmentPlacement>& placements, bool dump);
+    bool _enlarge();
+    bool _fitOne(FragmentPlacement& where, const AtlasFragment& frag, const char *name, const std::vector<ivec2>& searched);
+    bool _searchExhaustive(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag, const std::vector<ivec2>& searched) const;
+    bool _searchSkyline(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag) const;
+    bool _searchFFT(ivec2& bestpos, size_t& bestshape, size_t& bestpage, const AtlasFragment& frag) const;
+    bool _preferFFT(const AtlasFragment& frag) const;
+    bool _isAllowed(const FragmentShape& shape) const;
+    std::vector<AtlasFragment> frags; // in the order they were added, never reordered
+    std::vector<FragmentSource> sources; // same index as frags
+    std::vector<size_t> placeOrder; // frags in the order they were placed by the last build() or optimize()
+    std::vector<AtlasPage*> pages; // all but the last one are maxPageSize in both directions
 };
@@ -0,0 +1,101 @@
+#include "atlasdump.h"
+
+AtlasDumper::AtlasDumper(const std::vector<AtlasFragment>& frags, const std::vector<FragmentSource>& sources, size_t maxQueued)
+    : _frags(frags), _sources(sources), _maxQueued(maxQueued), _th(NULL), _pending(0), _written(0), _dropped(0), _flushing(false), _quit(false)
+{
+    tws_lwsem_init(&_lock, 1);
+    tws_lwsem_init(&_avail, 0);
+    tws_lwsem_init(&_idle, 0);
+    _th = tws_thread_create(_threadEntry, "atlasdump", this);
+}
+
+AtlasDumper::~AtlasDumper()
+{
+    flush();
+    if(_th)
+    {
+        _quit = true;
+        tws_lwsem_release(&_avail, 1);
+        tws_thread_join(_th);
+    }
+    tws_lwsem_destroy(&_idle);
+    tws_lwsem_destroy(&_avail);
+    tws_lwsem_destroy(&_lock);
+}
+
+bool AtlasDumper::full()
+{
+    tws_lwsem_acquire(&_lock, 256);
+    const bool isfull = _queue.size() >= _maxQueued;
+    tws_lwsem_release(&_lock, 1);
+    if(isfull)
+        ++_dropped;
+    return isfull;
+}
+
+void AtlasDumper::push(AtlasDumpFrame *frame)
+{
+    tws_lwsem_acquire(&_lock, 256);
+    const bool isfull = _queue.size() >= _maxQueued;
+    if(!isfull)
+    {
+        _queue.push_back(frame);
+        ++_pending;
+    }
+    tws_lwsem_release(&_lock, 1);
+
+    if(isfull)
+    {
+        ++_dropped;
+        delete frame;
+    }
+    else if(_th)
+        tws_lwsem_release(&_avail, 1);
+    else
+        _run(); // no thread, do it right here
+}
+
+void AtlasDumper::flush()
+{
+    tws_lwsem_acquire(&_lock, 256);
+    const bool wait = _pending != 0;
+    _flushing = wait;
+    tws_lwsem_release(&_lock, 1);
+    if(wait)
+        tws_lwsem_acquire(&_idle, 256);
+}
+
+void AtlasDumper::_threadEntry(void *ud)
+{
+    AtlasDumper *self = static_cast<AtlasDumper*>(ud);
+    for(;;)
+    {
+        tws_lwsem_acquire(&self->_avail, 0);
+        if(self->_quit)
+            break;
+        self->_run();
+    }
+}
+
+// Writes one frame
+void AtlasDumper::_run()
+{
+    tws_lwsem_acquire(&_lock, 256);
+    AtlasDumpFrame *frame = _queue.front();
+    _queue.pop_front();
+    tws_lwsem_release(&_lock, 1);
+
+    Image2d img;
+    Atlas::RenderPage(img, frame->width, frame->height, frame->block, frame->usageBlocks, frame->distanceBlocks, frame->page, _frags, _sources, frame->placements);
+    img.writePNG(frame->filename.c_str());
+    delete frame;
+
+    tws_lwsem_acquire(&_lock, 256);
+    ++_written;
+    const bool wake = !--_pending && _flushing;
+    if(wake)
+        _flushing = false;
+    tws_lwsem_release(&_lock, 1);
+    if(wake)
+        tws_lwsem_release(&_idle, 1);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "atlas.h"
+#include "tws_thread.h"
+#include <deque>
+
+// Snapshot of one atlas page while packing; only what can't be looked up in the fragments later
+struct AtlasDumpFrame
+{
+    std::string filename;
+    size_t page;
+    size_t width, height; // in pixels
+    uvec2 block;
+    Array2d<unsigned char> usageBlocks;
+    Array2d<float> distanceBlocks;
+    std::vector<FragmentPlacement> placements;
+};
+
+// Renders frames and writes them as PNG on a background thread.
+// Never makes the packer wait: When the queue is full, new frames are dropped.
+class AtlasDumper
+{
+public:
+    // frags and sources must not change until flush() returns
+    AtlasDumper(const std::vector<AtlasFragment>& frags, const std::vector<FragmentSource>& sources, size_t maxQueued);
+    ~AtlasDumper(); // flushes
+    bool full(); // check before making a frame, dropping one is cheaper than making it
+    void push(AtlasDumpFrame *frame); // takes ownership
+    void flush(); // blocks until everything queued is written
+
+    size_t written() const { return _written; }
+    size_t dropped() const { return _dropped; }
+
+private:
+    AtlasDumper(const AtlasDumper&); // non-copyable
+    AtlasDumper& operator=(const AtlasDumper&);
+
+    static void _threadEntry(void *ud);
+    void _run();
+
+    const std::vector<AtlasFragment>& _frags;
+    const std::vector<FragmentSource>& _sources;
+    const size_t _maxQueued;
+    std::deque<AtlasDumpFrame*> _queue;
+    tws_LWsem _lock; // protects _queue, _pending, _flushing
+    tws_LWsem _avail; // one count per queued frame
+    tws_LWsem _idle; // released when the last pending frame is written while flush() waits
+    tws_Thread *_th;
+    size_t _pending; // frames queued or being written
+    size_t _written, _dropped;
+    bool _flushing;
+    bool _quit;
+};
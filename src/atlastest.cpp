@@ -0,0 +1,172 @@
+// Packs a small image, its mirror and a copy of the mirror, and checks that every placed triangle
+// shows the same pixels in the atlas as in its source image:
+// - after building twice with dedupe on
+// - after building with dedupe on, then again with it off
+// - after building with 4x4 blocks, then again with 6x6 blocks
+// Writes its input images to the current directory.
+
+#include <stdio.h>
+#include <string.h>
+#include "atlas.h"
+#include "vertexbuf.h"
+
+static const char * const s_files[] = { "_atlastest_a.png", "_atlastest_b.png", "_atlastest_c.png" };
+
+// An asymmetric shape with a different color in every pixel, so neither a misplaced nor a wrongly mirrored fragment goes unnoticed
+static bool writeImages()
+{
+    const size_t W = 48, H = 40;
+    Image2d a(W, H), b(W, H);
+    for(size_t y = 0; y < H; ++y)
+        for(size_t x = 0; x < W; ++x)
+        {
+            const bool used = x >= 4 && y >= 4 && x < 44 && y < 36 && (x - 4) * 4 <= (y - 4) * 5;
+            Pixel p = { (unsigned char)(x * 5), (unsigned char)(y * 6), (unsigned char)(x * y), (unsigned char)(used ? 0xff : 0) };
+            if(!used)
+                p.r = p.g = p.b = 0;
+            a(x, y) = p;
+            b(W - 1 - x, y) = p;
+        }
+    return a.writePNG(s_files[0]) && b.writePNG(s_files[1]) && b.writePNG(s_files[2]);
+}
+
+// Number of sampled points inside triangles that show a different pixel in the atlas than in the source
+static size_t checkPixels(const Atlas& atlas)
+{
+    std::vector<Image2d> pages(atlas.numPages());
+    for(size_t p = 0; p < pages.size(); ++p)
+        atlas.composePage(pages[p], p);
+
+    size_t bad = 0;
+    for(size_t i = 0; i < atlas.numFragments(); ++i)
+    {
+        const AtlasFragment& frag = atlas.fragment(i);
+        const FragmentSource& src = atlas.source(i);
+        if(!frag.placed)
+        {
+            printf("%s: not placed\n", src.filename.c_str());
+            ++bad;
+            continue;
+        }
+
+        // Where each exported vertex is in src.img, and where in the atlas
+        const AtlasFragment& packed = frag.alias != size_t(-1) ? atlas.fragment(frag.alias) : frag;
+        const std::vector<uvec2>& uv = packed.shapes[frag.shape].points;
+        std::vector<ivec2> pos;
+        if(src.aliasStrip.empty())
+            for(size_t k = 0; k < src.points.size(); ++k)
+                pos.push_back(ivec2(src.points[k]));
+        else
+        {
+            const AABB box = src.poly.getBoundingRect();
+            for(size_t k = 0; k < src.aliasPoly.points.size(); ++k)
+                pos.push_back(ivec2(int(src.aliasPoly.points[k].x) - int(box.x1), int(src.aliasPoly.points[k].y) - int(box.y1)));
+        }
+        std::vector<Tri> tris;
+        indexListToTris(tris, &src.exportStrip()[0], src.exportStrip().size(), TRIMODE_STRIP);
+
+        // Points are pixel cells, so sample inside the triangles on a grid of barycentric coordinates and round
+        const int D = 13;
+        for(size_t t = 0; t < tris.size(); ++t)
+        {
+            const Tri& tri = tris[t];
+            for(int wa = 1; wa < D; ++wa)
+                for(int wb = 1; wa + wb < D; ++wb)
+                {
+                    const int wc = D - wa - wb;
+                    const int sx = pos[tri.a].x * wa + pos[tri.b].x * wb + pos[tri.c].x * wc;
+                    const int sy = pos[tri.a].y * wa + pos[tri.b].y * wb + pos[tri.c].y * wc;
+                    if(sx < 0 || sy < 0 || sx % D == 0 || sy % D == 0)
+                        continue; // exactly between two pixels
+                    const size_t px = (2 * sx + D) / (2 * D), py = (2 * sy + D) / (2 * D);
+                    if(px >= src.img.width() || py >= src.img.height() || !src.img(px, py).a)
+                        continue; // a mirrored crop may differ where nothing is visible
+                    const int ax = int(uv[tri.a].x) * wa + int(uv[tri.b].x) * wb + int(uv[tri.c].x) * wc;
+                    const int ay = int(uv[tri.a].y) * wa + int(uv[tri.b].y) * wb + int(uv[tri.c].y) * wc;
+                    const size_t qx = (2 * ax + D) / (2 * D) + frag.location.x, qy = (2 * ay + D) / (2 * D) + frag.location.y;
+                    const Image2d& page = pages[frag.page];
+                    if(qx >= page.width() || qy >= page.height() || memcmp(&src.img(px, py), &page(qx, qy), sizeof(Pixel)))
+                        ++bad;
+                }
+        }
+    }
+    return bad;
+}
+
+static size_t countAliases(const Atlas& atlas)
+{
+    size_t n = 0;
+    for(size_t i = 0; i < atlas.numFragments(); ++i)
+        n += atlas.fragment(i).alias != size_t(-1);
+    return n;
+}
+
+// Number of packed fragments that aren't on the block grid
+static size_t countMisaligned(const Atlas& atlas)
+{
+    size_t n = 0;
+    for(size_t i = 0; i < atlas.numFragments(); ++i)
+    {
+        const AtlasFragment& frag = atlas.fragment(i);
+        n += frag.placed && (frag.location.x % atlas.blockSize.x || frag.location.y % atlas.blockSize.y);
+    }
+    return n;
+}
+
+static bool check(const char *what, const Atlas& atlas, bool ok, size_t aliases)
+{
+    const size_t bad = checkPixels(atlas) + countMisaligned(atlas);
+    const size_t n = countAliases(atlas);
+    const bool pass = ok && !bad && n == aliases;
+    printf("%s: %s (build %s, %u bad pixels or placements, %u/%u aliases)\n", what, pass ? "PASS" : "FAIL", ok ? "ok" : "failed",
+        (unsigned)bad, (unsigned)n, (unsigned)aliases);
+    return pass;
+}
+
+static bool load(Atlas& atlas)
+{
+    for(size_t i = 0; i < Countof(s_files); ++i)
+        if(!atlas.addFile(s_files[i]))
+            return false;
+    return true;
+}
+
+int main()
+{
+    if(!writeImages())
+    {
+        printf("Failed to write test images\n");
+        return 1;
+    }
+
+    bool pass = true;
+    {
+        Atlas atlas;
+        if(!load(atlas))
+            return 1;
+        const size_t aliases = Countof(s_files) - 1; // all point at the first image
+        pass &= check("dedupe, first build", atlas, atlas.build(), aliases);
+        pass &= check("dedupe, second build", atlas, atlas.build(), aliases);
+    }
+    {
+        Atlas atlas;
+        if(!load(atlas))
+            return 1;
+        pass &= check("dedupe on", atlas, atlas.build(), Countof(s_files) - 1);
+        atlas.dedupe = false;
+        pass &= check("then off", atlas, atlas.build(), 0);
+    }
+
+    {
+        Atlas atlas;
+        if(!load(atlas))
+            return 1;
+        pass &= check("4x4 blocks", atlas, atlas.build(), Countof(s_files) - 1);
+        atlas.blockSize = uvec2(6, 6);
+        pass &= check("then 6x6", atlas, atlas.build(), Countof(s_files) - 1);
+    }
+
+    for(size_t i = 0; i < Countof(s_files); ++i)
+        remove(s_files[i]);
+    return pass ? 0 : 1;
+}
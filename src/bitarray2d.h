@@ -0,0 +1,189 @@
+#pragma once
+
+#include "array2d.h"
+#include "util.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// 1 bit per cell, each row packed into 64-bit words.
+// Every row has one extra zero word at the end so that unaligned 64-bit reads never go out of bounds.
+class BitArray2d : public Array2dAny
+{
+protected:
+    size_t _stride; // in words, including padding
+    std::vector<u64> _v;
+
+public:
+    BitArray2d() : Array2dAny(), _stride(0) {}
+    BitArray2d(size_t w, size_t h) : Array2dAny(), _stride(0) { init(w, h); }
+
+    // All bits are cleared after this
+    void init(size_t w, size_t h)
+    {
+        _w = w;
+        _h = h;
+        _stride = (w + 63) / 64u + 1;
+        _v.assign(_stride * h, 0);
+    }
+
+    void clear()
+    {
+        _w = _h = _stride = 0;
+        _v.clear();
+    }
+
+    void resize(size_t w, size_t h)
+    {
+        BitArray2d cp;
+        cp.swap(*this);
+        init(w, h);
+        const size_t cph = std::min(h, cp.height());
+        const size_t words = std::min(_stride, cp._stride) - 1;
+        for(size_t y = 0; y < cph; ++y)
+            std::copy(cp.row(y), cp.row(y) + words, row(y));
+        if(w && w < cp.width()) // chop off any bits past the new width; with no width there's only the padding word
+            for(size_t y = 0; y < cph; ++y)
+                row(y)[_stride - 2] &= lowmask(w - (_stride - 2) * 64);
+    }
+
+    void swap(BitArray2d& other)
+    {
+        _v.swap(other._v);
+        std::swap(_w, other._w);
+        std::swap(_h, other._h);
+        std::swap(_stride, other._stride);
+    }
+
+    // Set bits wherever a is non-zero
+    template<typename T>
+    void initFrom(const Array2d<T>& a)
+    {
+        init(a.width(), a.height());
+        for(size_t y = 0; y < _h; ++y)
+        {
+            const T *src = a.row(y);
+            u64 *dst = row(y);
+            for(size_t x = 0; x < _w; ++x)
+                if(src[x])
+                    dst[x / 64u] |= u64(1) << (x & 63);
+        }
+    }
+
+    // Padding and bits past the width are always zero, so this compares just the cells
+    bool operator==(const BitArray2d& o) const { return _w == o._w && _h == o._h && _v == o._v; }
+
+    inline bool get(size_t x, size_t y) const { return (row(y)[x / 64u] >> (x & 63)) & 1; }
+    inline void set(size_t x, size_t y) { row(y)[x / 64u] |= u64(1) << (x & 63); }
+
+    inline size_t stride() const { return _stride; }
+    inline size_t words() const { return _stride - 1; } // without padding
+
+    const u64 *row(size_t y) const { return &_v[y * _stride]; }
+          u64 *row(size_t y)       { return &_v[y * _stride]; }
+
+    // 64 bits starting at bit x. x may be anywhere in the row.
+    static inline u64 extract(const u64 *row, size_t x)
+    {
+        const size_t i = x / 64u;
+        const unsigned s = unsigned(x & 63);
+        return s ? (row[i] >> s) | (row[i+1] << (64 - s)) : row[i];
+    }
+
+    static inline u64 lowmask(size_t n)
+    {
+        return n >= 64 ? ~u64(0) : (u64(1) << n) - 1;
+    }
+
+    static inline unsigned popcount(u64 v)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        return unsigned(__popcnt64(v));
+#elif defined(__GNUC__)
+        return unsigned(__builtin_popcountll(v));
+#else
+        v = v - ((v >> 1) & 0x5555555555555555ull);
+        v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+        v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        return unsigned((v * 0x0101010101010101ull) >> 56);
+#endif
+    }
+
+    // dst[k] = a[k] | b[k] for n words. dst may be a or b.
+    static void orWords(u64 *dst, const u64 *a, const u64 *b, size_t n)
+    {
+        size_t k = 0;
+#ifdef __AVX2__
+        for( ; k + 4 <= n; k += 4)
+        {
+            const __m256i va = _mm256_loadu_si256((const __m256i*)(a + k));
+            const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + k));
+            _mm256_storeu_si256((__m256i*)(dst + k), _mm256_or_si256(va, vb));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for( ; k + 2 <= n; k += 2)
+        {
+            const __m128i va = _mm_loadu_si128((const __m128i*)(a + k));
+            const __m128i vb = _mm_loadu_si128((const __m128i*)(b + k));
+            _mm_storeu_si128((__m128i*)(dst + k), _mm_or_si128(va, vb));
+        }
+#endif
+        for( ; k < n; ++k)
+            dst[k] = a[k] | b[k];
+    }
+
+    // Test row y of other against row yo+y of this, with other shifted right by xo bits
+    bool rowIntersects(const BitArray2d& other, size_t y, size_t xo, size_t yo) const
+    {
+        const u64 * const pa = row(yo + y);
+        const u64 * const pb = other.row(y);
+        const size_t n = other.words();
+        size_t k = 0;
+#ifdef __AVX2__
+        if(n >= 4)
+        {
+            const size_t i = xo / 64u;
+            const __m128i sh = _mm_cvtsi32_si128(int(xo & 63));
+            const __m128i sh2 = _mm_cvtsi32_si128(int(64 - (xo & 63))); // shifting by 64 gives 0, which is what we want
+            for( ; k + 4 <= n; k += 4)
+            {
+                const __m256i lo = _mm256_loadu_si256((const __m256i*)(pa + i + k));
+                const __m256i hi = _mm256_loadu_si256((const __m256i*)(pa + i + k + 1));
+                const __m256i a = _mm256_or_si256(_mm256_srl_epi64(lo, sh), _mm256_sll_epi64(hi, sh2));
+                const __m256i b = _mm256_loadu_si256((const __m256i*)(pb + k));
+                if(!_mm256_testz_si256(a, b))
+                    return true;
+            }
+        }
+#endif
+        for( ; k < n; ++k)
+            if(extract(pa, xo + k * 64) & pb[k])
+                return true;
+        return false;
+    }
+
+    // OR all set bits of src into this, at offset (xo, yo)
+    void blitOr(const BitArray2d& src, size_t xo, size_t yo)
+    {
+        assert(xo + src.width() <= width() && yo + src.height() <= height());
+        const size_t n = src.words();
+        const unsigned s = unsigned(xo & 63);
+        for(size_t y = 0; y < src.height(); ++y)
+        {
+            u64 *dst = row(yo + y) + xo / 64u;
+            const u64 *p = src.row(y);
+            for(size_t k = 0; k < n; ++k)
+            {
+                dst[k] |= p[k] << s;
+                if(s)
+                    dst[k+1] |= p[k] >> (64 - s);
+            }
+        }
+    }
+};
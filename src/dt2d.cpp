@@ -54,3 +54,81 @@ void dt2d_solidToDT(float *dist, const unsigned char *solid, size_t w, size_t h)
 
     finishdist(dist, w, h);
 }
+
+void dt2d_solidToDT(DT2dState& st, float *dist, const unsigned char *solid, size_t w, size_t h)
+{
+    const size_t N = w * h;
+    st.w = w;
+    st.h = h;
+    st.cols.resize(N);
+    initdist(&st.cols[0], solid, N);
+
+    size_t wrksz = dt::wrkSize<float>(std::max(w,h));
+    size_t tmpsz = sizeof(float) * h;
+    char *wrk = (char*)malloc(wrksz + tmpsz);
+    float *tmp = (float*)(wrk + wrksz);
+    performY(&st.cols[0], w, h, wrk, tmp);
+    st.sq = st.cols;
+    performX(&st.sq[0], w, h, wrk);
+    free(wrk);
+
+    memcpy(dist, &st.sq[0], N * sizeof(float));
+    finishdist(dist, w, h);
+}
+
+// Cells only ever become solid, so distances can only shrink.
+// Only the columns in the rect change in the first pass; redo those.
+// In the second pass, a row that changed gets the lower envelope of only the changed columns,
+// which is then merged with the previous result. All values involved are integers, so the min() is exact.
+void dt2d_addSolid(DT2dState& st, float *dist, const unsigned char *solid, size_t x, size_t y, size_t rw, size_t rh)
+{
+    (void)y; (void)rh; // whole columns are affected
+    const size_t w = st.w, h = st.h;
+    const size_t xend = std::min(x + rw, w);
+    if(x >= xend)
+        return;
+
+    size_t wrksz = dt::wrkSize<float>(std::max(w,h));
+    size_t tmpsz = sizeof(float) * std::max(w,h);
+    char *wrk = (char*)malloc(wrksz + tmpsz);
+    float *in = (float*)wrk;
+    float *tmp = (float*)(wrk + wrksz);
+
+    std::vector<char> rowChanged(h, 0);
+    for(size_t xx = x; xx < xend; ++xx)
+    {
+        for(size_t yy = 0; yy < h; ++yy)
+            in[yy] = solid[yy*w + xx] ? 0.0f : MAX_VAL;
+        dt::linear_1d(tmp, wrk, h, MAX_VAL);
+        for(size_t yy = 0; yy < h; ++yy)
+        {
+            float& c = st.cols[yy*w + xx];
+            if(tmp[yy] != c)
+            {
+                c = tmp[yy];
+                rowChanged[yy] = 1;
+            }
+        }
+    }
+
+    const float m = 1.0f / sqrtf(float(w*w + h*h)); // same as in finishdist()
+    for(size_t yy = 0; yy < h; ++yy)
+        if(rowChanged[yy])
+        {
+            const float *c = &st.cols[yy*w];
+            for(size_t xx = 0; xx < w; ++xx)
+                in[xx] = xx >= x && xx < xend ? c[xx] : MAX_VAL;
+            dt::linear_1d(tmp, wrk, w, MAX_VAL);
+
+            float *sq = &st.sq[yy*w];
+            float *d = &dist[yy*w];
+            for(size_t xx = 0; xx < w; ++xx)
+                if(tmp[xx] < sq[xx])
+                {
+                    sq[xx] = tmp[xx];
+                    d[xx] = m * sqrtf(tmp[xx]);
+                }
+        }
+
+    free(wrk);
+}
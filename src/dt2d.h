@@ -1,6 +1,21 @@
 #pragma once
 
+#include <stddef.h>
 #include <vector>
 
 void dt2d_solidToDT(float *dist, const unsigned char *solid, size_t w, size_t h);
 
+// Intermediate results of a full distance transform, needed for incremental updates
+struct DT2dState
+{
+    size_t w, h;
+    std::vector<float> cols; // squared distances along columns only
+    std::vector<float> sq; // squared distances
+};
+
+void dt2d_solidToDT(DT2dState& st, float *dist, const unsigned char *solid, size_t w, size_t h);
+
+// Call after cells inside the given rect became solid (cells must never become non-solid).
+// Only touches what can change; same result as a full recompute.
+void dt2d_addSolid(DT2dState& st, float *dist, const unsigned char *solid, size_t x, size_t y, size_t rw, size_t rh);
+
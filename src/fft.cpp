@@ -0,0 +1,89 @@
+#include "fft.h"
+#include "threadpool.h"
+#include <math.h>
+#include <assert.h>
+
+FFT::FFT(size_t n)
+    : _n(n), _tw(n / 2), _rev(n)
+{
+    assert(n && !(n & (n - 1)));
+
+    // Computing each twiddle directly is more precise than any recurrence
+    const double a = -2.0 * 3.14159265358979323846 / double(n);
+    for(size_t k = 0; k < n / 2; ++k)
+        _tw[k] = cplx(cos(a * k), sin(a * k));
+
+    size_t bits = 0;
+    while((size_t(1) << bits) < n)
+        ++bits;
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t r = 0;
+        for(size_t b = 0; b < bits; ++b)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        _rev[i] = r;
+    }
+}
+
+void FFT::transform(cplx *data, bool inverse) const
+{
+    for(size_t i = 0; i < _n; ++i)
+        if(i < _rev[i])
+            std::swap(data[i], data[_rev[i]]);
+
+    for(size_t len = 2; len <= _n; len *= 2)
+    {
+        const size_t half = len / 2, step = _n / len;
+        for(size_t i = 0; i < _n; i += len)
+            for(size_t k = 0; k < half; ++k)
+            {
+                const cplx w = inverse ? std::conj(_tw[k * step]) : _tw[k * step];
+                const cplx u = data[i + k];
+                const cplx v = data[i + k + half] * w;
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+    }
+}
+
+struct FFTRows
+{
+    cplx *data;
+    const FFT& fx;
+    bool inverse;
+
+    FFTRows(cplx *data, const FFT& fx, bool inverse) : data(data), fx(fx), inverse(inverse) {}
+    void operator()(size_t y)
+    {
+        fx.transform(data + y * fx.size(), inverse);
+    }
+};
+
+// Columns are gathered into a buffer first, transforming them with a stride would thrash the cache
+struct FFTCols
+{
+    cplx *data;
+    const FFT& fx;
+    const FFT& fy;
+    bool inverse;
+
+    FFTCols(cplx *data, const FFT& fx, const FFT& fy, bool inverse) : data(data), fx(fx), fy(fy), inverse(inverse) {}
+    void operator()(size_t x)
+    {
+        const size_t w = fx.size(), h = fy.size();
+        std::vector<cplx> col(h);
+        for(size_t y = 0; y < h; ++y)
+            col[y] = data[y * w + x];
+        fy.transform(&col[0], inverse);
+        for(size_t y = 0; y < h; ++y)
+            data[y * w + x] = col[y];
+    }
+};
+
+void fft2d(cplx *data, const FFT& fx, const FFT& fy, bool inverse, ThreadPool *pool)
+{
+    FFTRows rows(data, fx, inverse);
+    parallelFor(pool, fy.size(), rows);
+    FFTCols cols(data, fx, fy, inverse);
+    parallelFor(pool, fx.size(), cols);
+}
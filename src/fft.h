@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <complex>
+#include <vector>
+
+class ThreadPool;
+
+typedef std::complex<double> cplx;
+
+// Radix-2 complex FFT for one fixed size (power of 2). Twiddles and bit reversal are precomputed.
+// Transforms are unnormalized; the inverse needs to be divided by n afterwards.
+class FFT
+{
+public:
+    FFT(size_t n);
+
+    size_t size() const { return _n; }
+    void transform(cplx *data, bool inverse) const; // n contiguous values, in place
+
+private:
+    size_t _n;
+    std::vector<cplx> _tw; // exp(-2*pi*i*k/n) for k < n/2
+    std::vector<size_t> _rev;
+};
+
+// In-place 2D FFT of a row-major array, fx.size() wide and fy.size() high.
+// Rows and columns are spread over the pool if there is one.
+void fft2d(cplx *data, const FFT& fx, const FFT& fy, bool inverse, ThreadPool *pool);
@@ -80,10 +80,3 @@ void Image2d::maskblit(const Image2d& top)
         if(p->a)
             *dst = *p;
 }
-
-Image2d& Image2d::operator=(const Image2d& o)
-{
-    this->init(o.width(), o.height());
-    this->copy2d(0, 0, o, 0, 0, o.width(), o.height());
-    return *this;
-}
@@ -20,13 +20,12 @@ class Image2d : public Array2d<Pixel>
 public:
     Image2d();
     Image2d(size_t w, size_t h);
+    // Copying and moving are inherited from Array2d
     bool writePNG(const char* fn) const;
     bool load(const char* fn);
     AABB getAlphaRegion() const;
     void copyscaled(const Image2d& src); // resize this to desired size before calling this
     void maskblit(const Image2d& top);
-
-    Image2d& operator=(const Image2d& o);
 };
 
 
@@ -4,5 +4,16 @@
 #include "polygon.h"
 
 class Image2d;
+class ThreadPool;
 
-std::vector<Polygon> mkpoly_twoband(const Image2d& img);
+// How polygons keep their distance around the solid pixels
+enum DilationMetric
+{
+    DILATE_CHESSBOARD, // grow by squares; what the parameter sets were tuned with
+    DILATE_EUCLIDEAN,  // grow by discs; hugs diagonal edges and corners tighter
+};
+
+// threads is optional; the parameter sets are tried on it in parallel.
+// If debugName is set, the intermediate images of every parameter set are written to _boundary/, _dilated/,
+// _polygonband/, _cc/ and _polygon/ as <debugName>_<parameters>.png. Those directories must exist.
+std::vector<Polygon> mkpoly_twoband(const Image2d& img, ThreadPool *threads = NULL, DilationMetric metric = DILATE_CHESSBOARD, const char *debugName = NULL);
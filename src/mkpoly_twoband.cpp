@@ -4,7 +4,11 @@
 #include "util.h"
 #include "polygon.h"
 #include "vertexbuf.h"
+#include "threadpool.h"
+#include "bitarray2d.h"
+#include "dt2d.h"
 #include <stdio.h>
+#include <math.h>
 #include <set>
 #include <sstream>
 
@@ -26,7 +30,39 @@ PixelFlag operator|(PixelFlag a, PixelFlag b) { return PixelFlag(size_t(a) | siz
 PixelFlag& operator|=(PixelFlag& a, PixelFlag b) { return (a = a | b); }
 
 
-typedef Array2d<PixelFlag> Flags2d;
+// One bit plane per flag, so that growing regions and finding edges works on 64 pixels at a time.
+// Single pixels can still be read as PixelFlag.
+class Flags2d : public Array2dAny
+{
+public:
+    BitArray2d solid; // PF_SOLID
+    BitArray2d dilated; // PF_DILATED
+    BitArray2d boundary; // PF_BOUNDARY
+    BitArray2d band; // PF_POLYGONBAND
+    BitArray2d nohole; // PF_NO_HOLE
+
+    void init(size_t w, size_t h)
+    {
+        _w = w;
+        _h = h;
+        solid.init(w, h);
+        dilated.init(w, h);
+        boundary.init(w, h);
+        band.init(w, h);
+        nohole.init(w, h);
+    }
+
+    PixelFlag operator()(size_t x, size_t y) const
+    {
+        size_t f = 0;
+        if(solid.get(x, y))    f |= PF_SOLID;
+        if(dilated.get(x, y))  f |= PF_DILATED;
+        if(boundary.get(x, y)) f |= PF_BOUNDARY;
+        if(band.get(x, y))     f |= PF_POLYGONBAND;
+        if(nohole.get(x, y))   f |= PF_NO_HOLE;
+        return PixelFlag(f);
+    }
+};
 
 static const Pixel TransparentPixel { 0,0,0,0 };
 static const Pixel BlackPixel { 0,0,0,255 };
@@ -40,65 +76,172 @@ static PixelFlag isNotFullyTransparent(Pixel p)
     return p.a ? PF_SOLID : PF_EMPTY;
 }
 
-static PixelFlag addBoundaryFlag(const GetValue<PixelFlag>& a, size_t x, size_t y)
+// Pixel x of a bit row is bit x & 63 of word x / 64. These give every pixel in word k the value of its
+// left or right neighbor, pixels outside are empty. Relies on bits past the width and the padding word being zero.
+static inline u64 fromLeft(const u64 *row, size_t k)
 {
-    struct Offs { int x, y; };
-    static const Offs offsets[] = { {-1, 0}, { 1,0 }, {0, -1}, {0, 1} }; // (+) shape around center pixel, not including center
-    PixelFlag here = a(x, y);
-    if(here & (PF_SOLID|PF_DILATED))
+    return (row[k] << 1) | (k ? row[k-1] >> 63 : 0);
+}
+static inline u64 fromRight(const u64 *row, size_t k)
+{
+    return (row[k] >> 1) | (row[k+1] << 63);
+}
+
+// Shifting or inverting may set bits past the width; clear those again
+static void clearPastWidth(BitArray2d& a)
+{
+    const size_t n = a.words();
+    if(!n)
+        return;
+    const u64 mask = BitArray2d::lowmask(a.width() - (n - 1) * 64);
+    for(size_t y = 0; y < a.height(); ++y)
+        a.row(y)[n-1] &= mask;
+}
+
+// dst = src with every set bit copied d pixels to the left and to the right, across words
+static void orShifted(u64 *dst, const u64 *src, size_t n, size_t d)
+{
+    const size_t q = d / 64u;
+    const unsigned b = unsigned(d & 63);
+    for(size_t k = 0; k < n; ++k)
+    {
+        u64 v = src[k];
+        if(k >= q) // from the left: pixel x - d, towards higher bits
+            v |= b ? (src[k-q] << b) | (k > q ? src[k-q-1] >> (64 - b) : 0) : src[k-q];
+        if(k + q < n) // from the right: pixel x + d
+            v |= b ? (src[k+q] >> b) | (k + q + 1 < n ? src[k+q+1] << (64 - b) : 0) : src[k+q];
+        dst[k] = v;
+    }
+}
+
+// out = in grown by r pixels in all 8 directions, pixels outside count as empty; the same as r steps of
+// a 3x3 neighborhood check. The square is separable. Rows grow by shifting what they have so far, which
+// triples the reach each time, so log3(r) word passes; columns by a running OR over blocks of 2r+1 rows (van Herk/Gil-Werman),
+// which costs the same for any r.
+static void dilateSquare(BitArray2d& out, const BitArray2d& in, size_t r)
+{
+    out = in;
+    if(!r)
+        return;
+    const size_t W = in.width(), H = in.height(), n = in.words();
+
+    std::vector<u64> tmp(n);
+    for(size_t y = 0; y < H; ++y)
     {
-        size_t solid = 0;
-        size_t empty = 0;
-        for(size_t i = 0; i < Countof(offsets); ++i)
+        u64 *row = out.row(y);
+        for(size_t span = 0; span < r; )
         {
-            Offs o = offsets[i];
-            if(a(x+o.x, y+o.y) & (PF_SOLID|PF_DILATED))
-                ++solid;
-            else
-                ++empty;
+            const size_t d = std::min(2 * span + 1, r - span); // [-span, span] and shifted by d still touch
+            std::copy(row, row + n, tmp.begin());
+            orShifted(row, &tmp[0], n, d);
+            span += d;
         }
-        if(empty && solid)
-            here |= PF_BOUNDARY;
     }
-    return here;
+    clearPastWidth(out);
+
+    // Rows y-r..y+r are one window. With r empty rows on either end, window y spans rows y..y+2r, and
+    // blocks of L = 2r+1 rows start at multiples of L, so every window is the end of one block (suffix)
+    // and the start of the next (prefix).
+    const size_t L = 2 * r + 1, P = H + 2 * r;
+    BitArray2d prefix(W, P), suffix(W, P);
+    for(size_t y = r; y < r + H; ++y)
+    {
+        std::copy(out.row(y - r), out.row(y - r) + n, prefix.row(y));
+        std::copy(out.row(y - r), out.row(y - r) + n, suffix.row(y));
+    }
+    for(size_t y = 1; y < P; ++y)
+        if(y % L)
+            BitArray2d::orWords(prefix.row(y), prefix.row(y), prefix.row(y - 1), n);
+    for(size_t y = P - 1; y--; )
+        if((y + 1) % L)
+            BitArray2d::orWords(suffix.row(y), suffix.row(y), suffix.row(y + 1), n);
+    for(size_t y = 0; y < H; ++y)
+        BitArray2d::orWords(out.row(y), suffix.row(y), prefix.row(y + 2 * r), n);
 }
 
-static PixelFlag addDilatedFlag(const GetValue<PixelFlag>& a, size_t x, size_t y)
+typedef Array2d<unsigned char> Dist2d;
+
+// Exact euclidean distance to the nearest seed in pixels, rounded up and saturated to 255.
+// Thresholding it grows regions as discs instead of squares, for any radius at the same cost.
+static void euclideanDistance(Dist2d& dist, const BitArray2d& seeds)
 {
-    PixelFlag here = a(x, y);
-    if(!(here & (PF_DILATED|PF_SOLID)))
+    const size_t W = seeds.width(), H = seeds.height(), N = W * H;
+    std::vector<unsigned char> solid(N);
+    for(size_t y = 0; y < H; ++y)
+        for(size_t x = 0; x < W; ++x)
+            solid[y * W + x] = seeds.get(x, y);
+    std::vector<float> d(N);
+    dt2d_solidToDT(&d[0], &solid[0], W, H);
+
+    // dt2d_solidToDT() scales to the image diagonal, undo that. Squared distances are whole numbers,
+    // so anything this close to a whole number of pixels is that number and only float error.
+    const float diag = sqrtf(float(W * W + H * H));
+    dist.init(W, H);
+    for(size_t y = 0; y < H; ++y)
     {
-        for(int yy = -1; yy <= 1; ++yy)
-            for(int xx = -1; xx <= 1; ++xx)
-                if(a(x+xx,y+yy) & (PF_SOLID | PF_DILATED))
-                    return here | PF_DILATED;
+        unsigned char *p = dist.row(y);
+        for(size_t x = 0; x < W; ++x)
+        {
+            const float px = d[y * W + x] * diag;
+            p[x] = px >= 255.0f ? 255 : (unsigned char)ceilf(px - 0.001f);
+        }
     }
-    return here;
 }
 
-static PixelFlag closeHoles(const GetValue<PixelFlag>& a, size_t x, size_t y)
+// out = pixels no further than r from what dist was made from
+static void withinDistance(BitArray2d& out, const Dist2d& dist, unsigned r)
 {
-    PixelFlag here = a(x, y);
-    if(!(here & (PF_DILATED|PF_SOLID|PF_NO_HOLE)))
-        here |= PF_DILATED;
-    return here;
+    const size_t W = dist.width(), H = dist.height();
+    out.init(W, H);
+    for(size_t y = 0; y < H; ++y)
+    {
+        const unsigned char *p = dist.row(y);
+        u64 *dst = out.row(y);
+        for(size_t x = 0; x < W; ++x)
+            dst[x / 64u] |= u64(p[x] <= r) << (x & 63);
+    }
 }
 
-static PixelFlag addPolygonFlag(const GetValue<PixelFlag>& a, size_t x, size_t y)
+// a &= ~b
+static void andNot(BitArray2d& a, const BitArray2d& b)
 {
-    PixelFlag here = a(x, y);
-    if(here & PF_SOLID)
-        return here; // can never construct polygon crossing solid area
-
-    if(here & PF_DILATED)
-        return here | PF_POLYGONBAND; // already dilated
+    for(size_t y = 0; y < a.height(); ++y)
+    {
+        u64 *pa = a.row(y);
+        const u64 *pb = b.row(y);
+        for(size_t k = 0; k < a.words(); ++k)
+            pa[k] &= ~pb[k];
+    }
+}
 
-    for(int yy = -1; yy <= 1; ++yy)
-        for(int xx = -1; xx <= 1; ++xx)
-            if(a(x+xx,y+yy) & (PF_POLYGONBAND|PF_SOLID|PF_DILATED))
-                return here | PF_POLYGONBAND;
+// a = b | c
+static void orPlanes(BitArray2d& a, const BitArray2d& b, const BitArray2d& c)
+{
+    a.init(b.width(), b.height());
+    for(size_t y = 0; y < a.height(); ++y)
+        BitArray2d::orWords(a.row(y), b.row(y), c.row(y), a.words());
+}
 
-    return here;
+// Solid or dilated pixels with both solid/dilated and other pixels among their 4 direct neighbors
+// (outside counts as other) are the boundary to the outside
+static void addBoundary(Flags2d& flags)
+{
+    BitArray2d used;
+    orPlanes(used, flags.solid, flags.dilated);
+    const size_t H = flags.height(), n = used.words();
+    for(size_t y = 0; y < H; ++y)
+    {
+        const u64 *u = used.row(y);
+        const u64 *up = y ? used.row(y - 1) : NULL;
+        const u64 *down = y + 1 < H ? used.row(y + 1) : NULL;
+        u64 *dst = flags.boundary.row(y);
+        for(size_t k = 0; k < n; ++k)
+        {
+            const u64 l = fromLeft(u, k), r = fromRight(u, k);
+            const u64 a = up ? up[k] : 0, b = down ? down[k] : 0;
+            dst[k] |= u[k] & (l | r | a | b) & ~(l & r & a & b);
+        }
+    }
 }
 
 struct ShowBit
@@ -121,77 +264,200 @@ inline static MetaPixel initMetaPixel(PixelFlag f)
     return p;
 }
 
-struct RegionAnnotator
+// Labels the connected regions of solid or dilated pixels (4 neighbors) with union-find.
+// Every used pixel points to an earlier pixel of its region, or to itself if it's the first one of the region
+// in scan order; that one is the root. Rows are split into stripes that are labeled on their own,
+// then the stripes are joined where they touch.
+struct RegionLabeler
 {
-    Meta2d& tofill;
-    unsigned cc;
+    Meta2d& meta;
+    std::vector<unsigned> parent; // per pixel; only valid for used pixels
+    size_t stripeRows;
+
+    RegionLabeler(Meta2d& meta, size_t stripes)
+        : meta(meta), parent(meta.width() * meta.height())
+        , stripeRows((meta.height() + stripes - 1) / stripes)
+    {}
 
-    struct Filler
+    static inline bool used(const MetaPixel& p)
     {
-        Filler(unsigned cc) : cc(cc) {}
-        const unsigned cc;
+        return !!(p.flag & (PF_SOLID|PF_DILATED));
+    }
 
-        template<typename A>
-        inline bool operator()(Meta2d& dst, const A& a, size_t x, size_t y)
+    unsigned find(unsigned i)
+    {
+        while(parent[i] != i)
         {
-            MetaPixel src = a(x,y);
-            if(src.cc || !(src.flag & (PF_SOLID|PF_DILATED)))
-                return false;
-
-            dst(x,y).cc = cc;
-            return true;
+            parent[i] = parent[parent[i]];
+            i = parent[i];
         }
-    };
+        return i;
+    }
 
+    // The earlier root wins, so a pixel's parent always comes before it
+    void unite(unsigned a, unsigned b)
+    {
+        a = find(a);
+        b = find(b);
+        if(a < b)
+            parent[b] = a;
+        else
+            parent[a] = b;
+    }
 
-    RegionAnnotator(Meta2d& tofill) : tofill(tofill), cc(0) {}
+    // Joins every pixel with its left and upper neighbor in the same stripe. Stripes touch disjoint parts of parent.
+    void operator()(size_t s)
+    {
+        const size_t W = meta.width();
+        const size_t y0 = s * stripeRows, y1 = std::min(y0 + stripeRows, meta.height());
+        const MetaPixel *mp = meta.data();
+        for(size_t y = y0; y < y1; ++y)
+            for(size_t x = 0; x < W; ++x)
+            {
+                const unsigned i = unsigned(y * W + x);
+                if(!used(mp[i]))
+                    continue;
+                parent[i] = i;
+                if(x && used(mp[i-1]))
+                    unite(i, i - 1);
+                if(y > y0 && used(mp[i-W]))
+                    unite(i, i - unsigned(W));
+            }
+    }
 
-    template<typename A>
-    MetaPixel operator()(const A& a, size_t x, size_t y)
+    // Joins the first row of each stripe with the row above
+    void joinStripes()
     {
-        size_t filled = floodfill(tofill, a, x, y, Filler(cc + 1));
-        if(filled)
-            ++cc;
+        const size_t W = meta.width();
+        const MetaPixel *mp = meta.data();
+        for(size_t y = stripeRows; y < meta.height(); y += stripeRows)
+            for(size_t x = 0; x < W; ++x)
+            {
+                const unsigned i = unsigned(y * W + x);
+                if(used(mp[i]) && used(mp[i-W]))
+                    unite(i, i - unsigned(W));
+            }
+    }
 
-        return a(x,y);
-    };
+    // Numbers the regions in scan order of their roots, from 1. The parent of each pixel is already
+    // pointing to its root when it's reached, so a single step finds any pixel's root.
+    unsigned number()
+    {
+        MetaPixel *mp = meta.data();
+        const size_t N = parent.size();
+        unsigned cc = 0;
+        for(size_t i = 0; i < N; ++i)
+            if(used(mp[i]))
+            {
+                const unsigned root = parent[parent[i]];
+                parent[i] = root;
+                mp[i].cc = root == i ? ++cc : mp[root].cc;
+            }
+        return cc;
+    }
 };
 
-struct NoHoleAnnotator
+// Within one word, spread the set bits of x over the runs of set bits in m that contain them, towards
+// higher bits (pixels to the right) or lower bits. x must be in m. Each step doubles the reach.
+static inline u64 spreadUp(u64 x, u64 m)
 {
-    Flags2d& tofill;
+    x |= m & (x << 1);  m &= m << 1;
+    x |= m & (x << 2);  m &= m << 2;
+    x |= m & (x << 4);  m &= m << 4;
+    x |= m & (x << 8);  m &= m << 8;
+    x |= m & (x << 16); m &= m << 16;
+    x |= m & (x << 32);
+    return x;
+}
+static inline u64 spreadDown(u64 x, u64 m)
+{
+    x |= m & (x >> 1);  m &= m >> 1;
+    x |= m & (x >> 2);  m &= m >> 2;
+    x |= m & (x >> 4);  m &= m >> 4;
+    x |= m & (x >> 8);  m &= m >> 8;
+    x |= m & (x >> 16); m &= m >> 16;
+    x |= m & (x >> 32);
+    return x;
+}
 
-    struct Filler
+// Fill the runs of m in a row that contain a bit of x, across words. x must be in m.
+static void fillRuns(u64 *x, const u64 *m, size_t n)
+{
+    u64 carry = 0; // the last pixel of the previous word is filled
+    for(size_t k = 0; k < n; ++k)
     {
-        template<typename A>
-        inline bool operator()(Flags2d& dst, const A& a, size_t x, size_t y)
-        {
-            PixelFlag src = a(x,y);
-            if(src & (PF_NO_HOLE|PF_SOLID|PF_DILATED))
-                return false; // already annotated or solid. solid is never a hole
-
-            for(int yy = -1; yy <= 1; ++yy)
-                for(int xx = -1; xx <= 1; ++xx)
-                    if(a(x+xx,y+yy) & PF_NO_HOLE)
-                    {
-                        dst(x,y) |= PF_NO_HOLE;
-                        return true; // anything next to known-not-a-hole is also not a hole
-                    }
+        x[k] = spreadUp(x[k] | (m[k] & carry), m[k]);
+        carry = x[k] >> 63;
+    }
+    carry = 0;
+    for(size_t k = n; k--; )
+    {
+        x[k] = spreadDown(x[k] | (m[k] & (carry << 63)), m[k]);
+        carry = x[k] & 1;
+    }
+}
 
-            return false;
+// One sweep over the rows from first to last (dir = 1) or back (dir = -1): each row takes what touches the
+// row before it (8 neighbors), then fills its runs. Returns true if anything changed.
+static bool sweepNoHoles(BitArray2d& nohole, const BitArray2d& open, int dir)
+{
+    const size_t H = nohole.height(), n = nohole.words();
+    std::vector<u64> touch(n);
+    bool changed = false;
+    for(size_t i = 1; i < H; ++i)
+    {
+        const size_t y = dir > 0 ? i : H - 1 - i;
+        const u64 *prev = nohole.row(y - dir);
+        const u64 *m = open.row(y);
+        u64 *x = nohole.row(y);
+        for(size_t k = 0; k < n; ++k)
+            touch[k] = x[k] | (m[k] & (prev[k] | fromLeft(prev, k) | fromRight(prev, k)));
+        fillRuns(&touch[0], m, n);
+        for(size_t k = 0; k < n; ++k)
+        {
+            changed |= touch[k] != x[k];
+            x[k] = touch[k];
         }
-    };
-
+    }
+    return changed;
+}
 
-    NoHoleAnnotator(Flags2d& tofill) : tofill(tofill) {}
+// Anything that isn't solid and is next to a known non-hole (or the image border) isn't a hole either,
+// so everything that isn't solid and is 8-connected to the border isn't.
+// Sweeps down and up until nothing changes; every sweep follows a path as far as it keeps its direction.
+static void markNoHoles(Flags2d& flags)
+{
+    const size_t W = flags.width(), H = flags.height(), n = flags.solid.words();
+    if(!W || !H)
+        return;
+    BitArray2d open(W, H);
+    for(size_t y = 0; y < H; ++y)
+    {
+        u64 *o = open.row(y);
+        const u64 *s = flags.solid.row(y), *d = flags.dilated.row(y);
+        for(size_t k = 0; k < n; ++k)
+            o[k] = ~(s[k] | d[k]);
+    }
+    clearPastWidth(open);
 
-    template<typename A>
-    PixelFlag operator()(const A& a, size_t x, size_t y)
+    // Seeds: the open pixels on the border
+    BitArray2d& nohole = flags.nohole;
+    for(size_t y = 0; y < H; ++y)
     {
-        size_t filled = floodfill(tofill, a, x, y, Filler());
-        return a(x,y);
-    };
-};
+        u64 *x = nohole.row(y);
+        const u64 *m = open.row(y);
+        if(!y || y == H - 1)
+            std::copy(m, m + n, x);
+        else
+        {
+            x[0] |= m[0] & 1;
+            x[(W - 1) / 64u] |= m[(W - 1) / 64u] & (u64(1) << ((W - 1) & 63));
+        }
+        fillRuns(x, m, n);
+    }
+
+    while(sweepNoHoles(nohole, open, 1) | sweepNoHoles(nohole, open, -1)) {}
+}
 
 struct ShowBitAndCC
 {
@@ -214,13 +480,17 @@ struct ShowBitAndCC
     }
 };
 
-static void distributeConnectedRegions(Meta2d& meta, const Flags2d& solid)
+// Same numbering as flood filling from every pixel in scan order would give, but in linear time
+static void distributeConnectedRegions(Meta2d& meta, const Flags2d& solid, ThreadPool *threads)
 {
-    MetaPixel oob { PF_EMPTY, unsigned(-1) };
     generate(meta, solid, initMetaPixel);
-    RegionAnnotator ra(meta);
-    generate2(meta, GetValue<MetaPixel>(meta, oob), ra);
-    printf("CC: %u\n", ra.cc);
+    if(!meta.width() || !meta.height())
+        return;
+    const size_t stripes = std::min<size_t>(threads ? threads->size() : 1, meta.height());
+    RegionLabeler labeler(meta, stripes);
+    parallelFor(threads, stripes, labeler);
+    labeler.joinStripes();
+    printf("CC: %u\n", labeler.number());
 }
 
 static bool generatePolygon(Polygon& poly, Array2d<char>& used, const GetValue<MetaPixel>& get, size_t x, size_t y, unsigned cc)
@@ -290,8 +560,8 @@ bool generatePolygons(std::vector<Polygon>& polys, const Meta2d& meta)
                         Polygon poly;
                         if(generatePolygon(poly, used, get, x, y, cc))
                         {
-                            polys.push_back(poly);
-                            printf("Generated polygon with %u points for CC %u\n", (unsigned)poly.points.size(), cc);
+                            polys.push_back(std::move(poly));
+                            printf("Generated polygon with %u points for CC %u\n", (unsigned)polys.back().points.size(), cc);
                         }
                         else
                         {
@@ -315,22 +585,11 @@ struct IsOutsideOfPolygonArea
 
     inline bool operator()(size_t x, size_t y) const
     {
-        return !(flags(x,y) & PF_POLYGONBAND);
+        return !flags.band.get(x, y);
     }
 
 };
 
-template<typename F>
-static void dilate(Flags2d& solid, size_t iterations, PixelFlag oob, F& f)
-{
-    Flags2d tmp; // can't dilate into the source buffer because dilation checks for the same flag it sets...
-    for(unsigned i = 0; i < iterations; ++i)
-    {
-        tmp.swap(solid); // ... so it's buffer ping-pong then.
-        generate2(solid, GetValue<PixelFlag>(tmp, oob), f);
-    }
-}
-
 static bool drawPolygonOutline(Image2d& out, const Image2d& src, const Polygon *polys, size_t N)
 {
     bool flop = false;
@@ -436,54 +695,87 @@ struct Params
     size_t segmentdist;
 };
 
-static size_t doPass(std::vector<Polygon>& polyout, const Image2d& img, const Params& params)
+// Flags of the solid pixels after dilating them, grown holds the dilated solid pixels
+static void makeDilated(Flags2d& flags, const BitArray2d& solid, const BitArray2d& grown)
 {
-    Image2d out;
-
-    Flags2d solid;
-    generate(solid, img, isNotFullyTransparent);
-    dilate(solid, params.dilation, PF_EMPTY, addDilatedFlag);
+    flags.init(solid.width(), solid.height());
+    flags.solid = solid;
+    flags.dilated = grown;
+    andNot(flags.dilated, solid);
+}
 
+static void closeHolesAndAddBoundary(Flags2d& flags)
+{
     // begin closing holes. anything that is non-solid and touches the border is not a hole.
-    generate2(solid, GetValue<PixelFlag>(solid, PF_NO_HOLE), NoHoleAnnotator(solid));
+    markNoHoles(flags);
 
     // any non-solid region that isn't known to be non-hole is actually a hole. Set PF_DILATED to close it.
-    generate2(solid, GetValue<PixelFlag>(solid, PF_SOLID), closeHoles);
+    for(size_t y = 0; y < flags.height(); ++y)
+    {
+        u64 *d = flags.dilated.row(y);
+        const u64 *s = flags.solid.row(y), *nh = flags.nohole.row(y);
+        for(size_t k = 0; k < flags.dilated.words(); ++k)
+            d[k] |= ~(s[k] | d[k] | nh[k]);
+    }
+    clearPastWidth(flags.dilated);
 
-    generate2(solid, GetValue<PixelFlag>(solid, PF_EMPTY), addBoundaryFlag);
-    dilate(solid, params.extraband, PF_EMPTY, addPolygonFlag);
+    addBoundary(flags);
+}
+
+// grown holds the pixels within n of the solid and dilated pixels of bounded
+static void makeBand(Flags2d& flags, const Flags2d& bounded, const BitArray2d& grown, size_t n)
+{
+    flags = bounded;
+    if(n)
+    {
+        flags.band = grown;
+        andNot(flags.band, flags.solid); // can never construct polygon crossing solid area
+    }
 
     // The polygon may always cut through the boundary regions
-    const size_t ymax = solid.height() - 1;
-    for(size_t x = 0; x < solid.width(); ++x)
+    const size_t ymax = flags.height() - 1;
+    for(size_t x = 0; x < flags.width(); ++x)
     {
-        solid(x, 0) |= PF_POLYGONBAND;
-        solid(x, ymax) |= PF_POLYGONBAND;
+        flags.band.set(x, 0);
+        flags.band.set(x, ymax);
     }
-    const size_t xmax = solid.width() - 1;
-    for(size_t y = 0; y < solid.height(); ++y)
+    const size_t xmax = flags.width() - 1;
+    for(size_t y = 0; y < flags.height(); ++y)
     {
-        solid(0, y) |= PF_POLYGONBAND;
-        solid(xmax, y) |= PF_POLYGONBAND;
+        flags.band.set(0, y);
+        flags.band.set(xmax, y);
     }
+}
 
+// Polygons for one parameter set, from the finished flags of its dilation and extraband.
+// Writes debug images only if debugName is set, see mkpoly_twoband().
+static size_t doPass(std::vector<Polygon>& polyout, const Image2d& img, const Flags2d& solid, const Params& params, ThreadPool *threads, const char *debugName)
+{
+    Image2d out;
 
-    char dbuf[128];
-    sprintf(dbuf, "/%02u_%02u_%02u.png", (unsigned)params.dilation, (unsigned)params.extraband,  (unsigned)params.segmentdist);
-    std::string dd = dbuf;
-
-    generate(out, solid, ShowBit(PF_BOUNDARY));
-    out.writePNG(("_boundary" + dd).c_str());
-    generate(out, solid, ShowBit(PF_DILATED));
-    out.writePNG(("_dilated" + dd).c_str());
-    generate(out, solid, ShowBit(PF_POLYGONBAND));
-    out.writePNG(("_polygonband" + dd).c_str());
+    std::string dd;
+    if(debugName)
+    {
+        char dbuf[64];
+        sprintf(dbuf, "_%02u_%02u_%02u.png", (unsigned)params.dilation, (unsigned)params.extraband,  (unsigned)params.segmentdist);
+        dd = std::string("/") + debugName + dbuf;
+
+        generate(out, solid, ShowBit(PF_BOUNDARY));
+        out.writePNG(("_boundary" + dd).c_str());
+        generate(out, solid, ShowBit(PF_DILATED));
+        out.writePNG(("_dilated" + dd).c_str());
+        generate(out, solid, ShowBit(PF_POLYGONBAND));
+        out.writePNG(("_polygonband" + dd).c_str());
+    }
 
     Meta2d meta;
-    distributeConnectedRegions(meta, solid);
+    distributeConnectedRegions(meta, solid, threads);
 
-    generate(out, meta, ShowBitAndCC(PF_BOUNDARY));
-    out.writePNG(("_cc" + dd).c_str());
+    if(debugName)
+    {
+        generate(out, meta, ShowBitAndCC(PF_BOUNDARY));
+        out.writePNG(("_cc" + dd).c_str());
+    }
 
     std::vector<Polygon> polys;
     if(!generatePolygons(polys, meta))
@@ -514,7 +806,7 @@ static size_t doPass(std::vector<Polygon>& polyout, const Image2d& img, const Pa
             return 0;
         }
 
-        simplepolys.push_back(*better);
+        simplepolys.push_back(std::move(*better));
         const Polygon& last = simplepolys.back();
 
         const size_t myscore = last.calcScore();
@@ -527,21 +819,23 @@ static size_t doPass(std::vector<Polygon>& polyout, const Image2d& img, const Pa
 
     ///// DEBUG //////
 
+    if(debugName)
+    {
+        generate(out, solid, ShowBit(PF_POLYGONBAND));
+        std::vector<unsigned> strip;
+        size_t striplen = genIndexBuffer_Strip(strip, &simplepolys[0], simplepolys.size(), false);
+        std::vector<Point2d> allpoints;
+        allpoints.reserve(strip.size() / 2);
+        for(size_t i = 0; i < simplepolys.size(); ++i)
+            allpoints.insert(allpoints.end(), simplepolys[i].points.begin(), simplepolys[i].points.end());
+        out = drawTrianglesOnImage(out, allpoints.data(),strip.data(), strip.size(), false);
 
-    generate(out, solid, ShowBit(PF_POLYGONBAND));
-    std::vector<unsigned> strip;
-    size_t striplen = genIndexBuffer_Strip(strip, &simplepolys[0], simplepolys.size(), false);
-    std::vector<Point2d> allpoints;
-    allpoints.reserve(strip.size() / 2);
-    for(size_t i = 0; i < simplepolys.size(); ++i)
-        allpoints.insert(allpoints.end(), simplepolys[i].points.begin(), simplepolys[i].points.end());
-    out = drawTrianglesOnImage(out, allpoints.data(),strip.data(), strip.size(), false);
-
-    out.writePNG(("_polygon" + dd).c_str());
+        out.writePNG(("_polygon" + dd).c_str());
+    }
 
     ////////////////////////
 
-    polyout = simplepolys;
+    polyout.swap(simplepolys);
 
     return score;
 }
@@ -571,15 +865,103 @@ struct PolyResult
     size_t score;
 };
 
-std::vector<Polygon> mkpoly_twoband(const Image2d& img)
+// The parameter sets share most of their work: The solid mask is the same for all, closing holes and
+// finding the boundary only depend on the dilation, and every band grows from what that leaves.
+// So all of that is done once, and only the polygons are made per set. Growing costs about the same
+// however far it reaches, see dilateSquare(); for DILATE_EUCLIDEAN each region's distance map is made
+// once and thresholded.
+// Each distinct dilation is one job with its own buffers that does the rest for all sets using it.
+// The debug images are named after the image and the parameter set, so nothing collides.
+struct PolyPasses
+{
+    const Image2d& img;
+    const DilationMetric metric;
+    ThreadPool *threads; // passed on to label regions in stripes; while the pool is busy with the groups, that runs serially
+    const char *debugName;
+    BitArray2d solid;
+    Dist2d solidDist; // to the nearest solid pixel; only for DILATE_EUCLIDEAN
+    std::vector<std::vector<size_t> > groups; // indices into s_params with the same dilation, by increasing extraband
+    PolyResult results[Countof(s_params)];
+
+    PolyPasses(const Image2d& img, DilationMetric metric, ThreadPool *threads, const char *debugName)
+        : img(img), metric(metric), threads(threads), debugName(debugName) {}
+    void operator()(size_t g)
+    {
+        const std::vector<size_t>& group = groups[g];
+        const bool euclidean = metric == DILATE_EUCLIDEAN;
+        Flags2d bounded, flags;
+        BitArray2d grown;
+        if(euclidean)
+            withinDistance(grown, solidDist, unsigned(s_params[group[0]].dilation));
+        else
+            dilateSquare(grown, solid, s_params[group[0]].dilation);
+        makeDilated(bounded, solid, grown);
+        closeHolesAndAddBoundary(bounded);
+
+        BitArray2d used;
+        Dist2d usedDist;
+        orPlanes(used, bounded.solid, bounded.dilated);
+        if(euclidean)
+            euclideanDistance(usedDist, used);
+        for(size_t i = 0; i < group.size(); ++i)
+        {
+            const Params& params = s_params[group[i]];
+            if(!i || params.extraband != s_params[group[i-1]].extraband)
+            {
+                if(euclidean)
+                    withinDistance(grown, usedDist, unsigned(params.extraband));
+                else
+                    dilateSquare(grown, used, params.extraband);
+                makeBand(flags, bounded, grown, params.extraband);
+            }
+            results[group[i]].score = doPass(results[group[i]].polys, img, flags, params, threads, debugName);
+        }
+    }
+};
+
+// By dilation, then by extraband
+struct ParamsLess
 {
-    PolyResult polys[Countof(s_params)];
+    bool operator()(size_t a, size_t b) const
+    {
+        const Params& pa = s_params[a], & pb = s_params[b];
+        return pa.dilation < pb.dilation || (pa.dilation == pb.dilation && pa.extraband < pb.extraband);
+    }
+};
+
+std::vector<Polygon> mkpoly_twoband(const Image2d& img, ThreadPool *threads, DilationMetric metric, const char *debugName)
+{
+    PolyPasses passes(img, metric, threads, debugName);
+    passes.solid.init(img.width(), img.height());
+    for(size_t y = 0; y < img.height(); ++y)
+        for(size_t x = 0; x < img.width(); ++x)
+            if(isNotFullyTransparent(img(x, y)))
+                passes.solid.set(x, y);
+
+    std::vector<size_t> order(Countof(s_params));
+    for(size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), ParamsLess());
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        if(passes.groups.empty() || s_params[passes.groups.back()[0]].dilation != s_params[order[i]].dilation)
+            passes.groups.push_back(std::vector<size_t>());
+        passes.groups.back().push_back(order[i]);
+    }
+
+    if(metric == DILATE_EUCLIDEAN)
+        euclideanDistance(passes.solidDist, passes.solid);
+
+    parallelFor(threads, passes.groups.size(), passes);
+
+    PolyResult *polys = passes.results;
     size_t bestscore = size_t(-1);
     size_t bestidx = 0;
 
+    // Same pick as a serial run: lowest score, ties go to the first set
     for(size_t i = 0; i < Countof(s_params); ++i)
     {
-        size_t score = doPass(polys[i].polys, img, s_params[i]);
+        const size_t score = polys[i].score;
         printf("=> Param set #%u (dilate=%u, band=%u, linelen=%u) score: %u\n",
             unsigned(i),
             unsigned(s_params[i].dilation),
@@ -587,7 +969,6 @@ std::vector<Polygon> mkpoly_twoband(const Image2d& img)
             unsigned(s_params[i].segmentdist),
             unsigned(score)
         );
-        polys[i].score = score;
 
         if(score && score < bestscore)
         {
@@ -600,7 +981,7 @@ std::vector<Polygon> mkpoly_twoband(const Image2d& img)
 
     printf("--> Best: %u\n", (unsigned)(bestidx-1));
 
-    const PolyResult& best = polys[bestidx-1];
+    PolyResult& best = polys[bestidx-1];
 
 
 
@@ -643,5 +1024,7 @@ std::vector<Polygon> mkpoly_twoband(const Image2d& img)
         }
     }*/
 
-    return best.polys;
+    std::vector<Polygon> ret;
+    ret.swap(best.polys);
+    return ret;
 }
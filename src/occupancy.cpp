@@ -0,0 +1,139 @@
+#include "occupancy.h"
+
+// Reduce 4x4 cells of src into one cell. Cells outside of src count as unused.
+static bool reduceAny(const BitArray2d& src, size_t cx, size_t cy)
+{
+    const size_t x = cx * 4, y = cy * 4;
+    const u64 mask = BitArray2d::lowmask(std::min<size_t>(4, src.width() - x));
+    const size_t yend = std::min(y + 4, src.height());
+    for(size_t yy = y; yy < yend; ++yy)
+        if(BitArray2d::extract(src.row(yy), x) & mask)
+            return true;
+    return false;
+}
+
+static bool reduceAll(const BitArray2d& src, size_t cx, size_t cy)
+{
+    const size_t x = cx * 4, y = cy * 4;
+    if(x + 4 > src.width() || y + 4 > src.height())
+        return false;
+    for(size_t yy = y; yy < y + 4; ++yy)
+        if((BitArray2d::extract(src.row(yy), x) & 0xf) != 0xf)
+            return false;
+    return true;
+}
+
+void FragmentPyramid::build(const BitArray2d& base)
+{
+    const BitArray2d *src = &base;
+    for(size_t i = 0; i < PYRAMID_LEVELS; ++i)
+    {
+        BitArray2d& dst = any[i];
+        dst.init((src->width() + 3) / 4u, (src->height() + 3) / 4u);
+        for(size_t y = 0; y < dst.height(); ++y)
+            for(size_t x = 0; x < dst.width(); ++x)
+                if(reduceAny(*src, x, y))
+                    dst.set(x, y);
+        src = &dst;
+    }
+}
+
+void AtlasPyramid::build(const BitArray2d& base)
+{
+    const BitArray2d *src = &base;
+    for(size_t i = 0; i < PYRAMID_LEVELS; ++i)
+    {
+        const size_t w = (src->width() + 3) / 4u, h = (src->height() + 3) / 4u;
+        full[i].init(w, h);
+        blocking[i].init(w, h);
+        _updateLevel(i, *src, 0, 0, w, h);
+        src = &full[i];
+    }
+}
+
+void AtlasPyramid::update(const BitArray2d& base, size_t x, size_t y, size_t w, size_t h)
+{
+    if(!w || !h)
+        return;
+    size_t x1 = x + w, y1 = y + h; // exclusive
+    const BitArray2d *src = &base;
+    for(size_t i = 0; i < PYRAMID_LEVELS; ++i)
+    {
+        x /= 4u;
+        y /= 4u;
+        x1 = (x1 + 3) / 4u;
+        y1 = (y1 + 3) / 4u;
+        _updateLevel(i, *src, x, y, x1, y1);
+        src = &full[i];
+    }
+}
+
+void AtlasPyramid::_updateLevel(size_t level, const BitArray2d& src, size_t x0, size_t y0, size_t x1, size_t y1)
+{
+    BitArray2d& f = full[level];
+    BitArray2d& b = blocking[level];
+    x1 = std::min(x1, f.width());
+    y1 = std::min(y1, f.height());
+
+    for(size_t y = y0; y < y1; ++y)
+        for(size_t x = x0; x < x1; ++x)
+            if(reduceAll(src, x, y))
+                f.set(x, y);
+
+    // Cells are never cleared, so only cells that might have become blocking need to be checked.
+    // A changed full cell affects the blocking cells to its left and top.
+    const size_t bx0 = x0 ? x0 - 1 : 0;
+    const size_t by0 = y0 ? y0 - 1 : 0;
+    const size_t w = f.width(), h = f.height();
+    for(size_t y = by0; y < y1 && y + 1 < h; ++y)
+        for(size_t x = bx0; x < x1 && x + 1 < w; ++x)
+            if(f.get(x, y) && f.get(x+1, y) && f.get(x, y+1) && f.get(x+1, y+1))
+                b.set(x, y);
+}
+
+void Skyline::build(const BitArray2d& base)
+{
+    height.assign(base.width(), 0);
+    for(size_t y = 0; y < base.height(); ++y)
+        for(size_t x = 0; x < base.width(); ++x)
+            if(base.get(x, y))
+                height[x] = y + 1;
+}
+
+void Skyline::update(const BitArray2d& frag, size_t x, size_t y)
+{
+    for(size_t fx = 0; fx < frag.width(); ++fx)
+        for(size_t fy = frag.height(); fy --> 0; )
+            if(frag.get(fx, fy))
+            {
+                height[x + fx] = std::max(height[x + fx], y + fy + 1);
+                break;
+            }
+}
+
+void Skyline::candidates(std::vector<ivec2>& out, const BitArray2d& frag, size_t w, size_t h) const
+{
+    const size_t fw = frag.width(), fh = frag.height();
+    if(fw > w || fh > h)
+        return;
+
+    // Topmost used block per fragment column
+    std::vector<size_t> top(fw, fh);
+    for(size_t fx = 0; fx < fw; ++fx)
+        for(size_t fy = 0; fy < fh; ++fy)
+            if(frag.get(fx, fy))
+            {
+                top[fx] = fy;
+                break;
+            }
+
+    for(size_t x = 0; x + fw <= w; ++x)
+    {
+        size_t y = 0;
+        for(size_t fx = 0; fx < fw; ++fx)
+            if(top[fx] < fh && height[x + fx] > top[fx])
+                y = std::max(y, height[x + fx] - top[fx]);
+        if(y + fh <= h)
+            out.push_back(ivec2(int(x), int(y)));
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "bitarray2d.h"
+#include "vec.h"
+
+// Coarse levels over a block occupancy map, used to reject whole groups of candidate positions at once.
+// Level i has cells of PyramidCellSize(i) x PyramidCellSize(i) base cells (blocks).
+enum { PYRAMID_LEVELS = 2 };
+
+inline size_t PyramidCellSize(size_t level) { return size_t(4) << (2 * level); }
+
+// Fragment side: A coarse cell is set if any base cell under it is used.
+struct FragmentPyramid
+{
+    BitArray2d any[PYRAMID_LEVELS];
+
+    void build(const BitArray2d& base);
+};
+
+// Atlas side: A coarse cell is "full" if all base cells under it are used.
+// blocking(x,y) is set if the 2x2 coarse cells starting at (x,y) are all full;
+// any fragment cell that ends up in there can not avoid a collision.
+struct AtlasPyramid
+{
+    BitArray2d full[PYRAMID_LEVELS];
+    BitArray2d blocking[PYRAMID_LEVELS];
+
+    void build(const BitArray2d& base);
+    void update(const BitArray2d& base, size_t x, size_t y, size_t w, size_t h); // after cells in that base rect were set
+
+    // True if frag collides at every position in the PyramidCellSize(level)-sized square of positions
+    // whose upper left position is (bx, by) * PyramidCellSize(level).
+    bool blocked(const FragmentPyramid& frag, size_t level, size_t bx, size_t by) const
+    {
+        const BitArray2d& b = blocking[level];
+        const BitArray2d& f = frag.any[level];
+        if(bx + f.width() > b.width() || by + f.height() > b.height())
+            return false;
+        for(size_t y = 0; y < f.height(); ++y)
+            if(b.rowIntersects(f, y, bx, by))
+                return true;
+        return false;
+    }
+
+private:
+    void _updateLevel(size_t level, const BitArray2d& src, size_t x0, size_t y0, size_t x1, size_t y1);
+};
+
+// Lowest used block per column. Things put onto the skyline can never collide,
+// but anything below an overhang is lost to it.
+struct Skyline
+{
+    std::vector<size_t> height; // per column: 1 + lowest used row, 0 if empty
+
+    void build(const BitArray2d& base);
+    void update(const BitArray2d& frag, size_t x, size_t y); // after frag was stamped in at (x, y)
+
+    // Append one position per column where frag rests on the skyline (or the top edge) and fits into (w, h)
+    void candidates(std::vector<ivec2>& out, const BitArray2d& frag, size_t w, size_t h) const;
+};
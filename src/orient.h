@@ -0,0 +1,76 @@
+#pragma once
+
+#include "array2d.h"
+#include "bitarray2d.h"
+#include "vec.h"
+
+// Orientation of a fragment in the atlas:
+// Mirror horizontally first if the mirror bit is set, then rotate by 90 degrees clockwise (o & 3) times.
+enum Orientation
+{
+    ORIENT_NORMAL = 0,
+    ORIENT_ROTATE_MASK = 3,
+    ORIENT_MIRROR = 4,
+    ORIENT_COUNT = 8
+};
+
+// Size after applying orientation o to something of size sz
+inline uvec2 orientSize(unsigned o, uvec2 sz)
+{
+    return (o & 1) ? uvec2(sz.y, sz.x) : sz;
+}
+
+// Map cell p of an area of size sz to where it ends up after applying orientation o
+inline uvec2 orientPoint(unsigned o, uvec2 p, uvec2 sz)
+{
+    if(o & ORIENT_MIRROR)
+        p.x = sz.x - 1 - p.x;
+    for(unsigned r = o & ORIENT_ROTATE_MASK; r; --r)
+    {
+        p = uvec2(sz.y - 1 - p.y, p.x);
+        sz = uvec2(sz.y, sz.x);
+    }
+    return p;
+}
+
+// Inverse of orientPoint(); sz is the size before the orientation was applied
+inline uvec2 unorientPoint(unsigned o, uvec2 p, uvec2 sz)
+{
+    uvec2 osz = orientSize(o, sz);
+    for(unsigned r = o & ORIENT_ROTATE_MASK; r; --r)
+    {
+        p = uvec2(p.y, osz.x - 1 - p.x); // rotate counter-clockwise
+        osz = uvec2(osz.y, osz.x);
+    }
+    if(o & ORIENT_MIRROR)
+        p.x = sz.x - 1 - p.x;
+    return p;
+}
+
+template<typename T>
+void orientArray(Array2d<T>& dst, const Array2d<T>& src, unsigned o)
+{
+    const uvec2 sz(unsigned(src.width()), unsigned(src.height()));
+    const uvec2 osz = orientSize(o, sz);
+    dst.init(osz.x, osz.y);
+    for(unsigned y = 0; y < sz.y; ++y)
+        for(unsigned x = 0; x < sz.x; ++x)
+        {
+            const uvec2 p = orientPoint(o, uvec2(x, y), sz);
+            dst(p.x, p.y) = src(x, y);
+        }
+}
+
+inline void orientArray(BitArray2d& dst, const BitArray2d& src, unsigned o)
+{
+    const uvec2 sz(unsigned(src.width()), unsigned(src.height()));
+    const uvec2 osz = orientSize(o, sz);
+    dst.init(osz.x, osz.y);
+    for(unsigned y = 0; y < sz.y; ++y)
+        for(unsigned x = 0; x < sz.x; ++x)
+            if(src.get(x, y))
+            {
+                const uvec2 p = orientPoint(o, uvec2(x, y), sz);
+                dst.set(p.x, p.y);
+            }
+}
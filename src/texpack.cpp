@@ -1,7 +1,24 @@
 #include "filesystem.h"
 #include "atlas.h"
+#include "threadpool.h"
+#include "image2d.h"
+#include <stdio.h>
 
 
+// The final textures, one per page, next to the status dumps
+static void writePages(const Atlas& atlas)
+{
+    Image2d img;
+    char buf[64];
+    for(size_t i = 0; i < atlas.numPages(); ++i)
+    {
+        atlas.composePage(img, i);
+        sprintf(buf, "_atlas/page%u.png", (unsigned)i);
+        if(!img.writePNG(buf))
+            printf("Failed to write '%s'\n", buf);
+    }
+}
+
 static void doDir(Atlas& atlas, const char *path)
 {
     std::vector<std::string> files;
@@ -12,23 +29,32 @@ static void doDir(Atlas& atlas, const char *path)
     std::string pathstr = path;
     pathstr += '/';
 
-    std::string tmp;
     for(size_t i = 0; i < files.size(); ++i)
-    {
-        tmp = pathstr;
-        tmp += files[i];
-        atlas.addFile(tmp.c_str());
-    }
+        files[i] = pathstr + files[i];
+    atlas.addFiles(files);
 
     atlas.build();
+    //atlas.optimize(60);
+    writePages(atlas);
 }
 
 
 int main(int argc, char *argv[])
 {
+    ThreadPool pool;
     Atlas atlas;
+    atlas.threads = &pool;
+    atlas.maxPageSize = 4096;
     //atlas.resize(2048, 1024);
     //atlas.updateDistanceMapInterval = 5;
+    atlas.searchMode = Atlas::SEARCH_AUTO; // or SEARCH_SKYLINE for speed over density
+    //atlas.blockSize = uvec2(6, 6); // to match ASTC 6x6 instead of BCn
+    //atlas.allowRotation = atlas.allowMirror = true;
+    //atlas.fineNudge = true;
+    //atlas.portfolio = 8;
+    //atlas.dumpInterval = 10;
+    //atlas.outlineMetric = DILATE_EUCLIDEAN;
+    //atlas.dumpPolygons = true;
 
     /*doOneImage("gear.png");
     doOneImage("face.png");
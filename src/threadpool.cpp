@@ -0,0 +1,71 @@
+#include "threadpool.h"
+#include <stdio.h>
+
+ThreadPool::ThreadPool(unsigned nthreads)
+    : _busy(false), _next(0), _f(NULL), _ud(NULL), _n(0), _quit(false)
+{
+    if(!nthreads)
+        nthreads = tws_cpu_count();
+    tws_lwsem_init(&_wake, 0);
+    tws_lwsem_init(&_checkout, 0);
+    for(unsigned i = 1; i < nthreads; ++i)
+        if(tws_Thread *th = tws_thread_create(_workerEntry, "worker", this))
+            _th.push_back(th);
+    printf("ThreadPool: %u threads\n", size());
+}
+
+ThreadPool::~ThreadPool()
+{
+    _quit = true;
+    if(!_th.empty())
+        tws_lwsem_release(&_wake, (unsigned)_th.size());
+    for(size_t i = 0; i < _th.size(); ++i)
+        tws_thread_join(_th[i]);
+    tws_lwsem_destroy(&_checkout);
+    tws_lwsem_destroy(&_wake);
+}
+
+void ThreadPool::_workerEntry(void *ud)
+{
+    ThreadPool *self = static_cast<ThreadPool*>(ud);
+    for(;;)
+    {
+        tws_lwsem_acquire(&self->_wake, 256);
+        if(self->_quit)
+            break;
+        self->_work();
+        tws_lwsem_release(&self->_checkout, 1);
+    }
+}
+
+void ThreadPool::_work()
+{
+    for(size_t i; (i = _next.fetch_add(1)) < _n; )
+        _f(_ud, i);
+}
+
+void ThreadPool::run(Func f, void *ud, size_t n)
+{
+    bool expected = false;
+    if(_th.empty() || n < 2 || !_busy.compare_exchange_strong(expected, true))
+    {
+        for(size_t i = 0; i < n; ++i)
+            f(ud, i);
+        return;
+    }
+
+    _f = f;
+    _ud = ud;
+    _n = n;
+    _next = 0;
+
+    // Every worker wakes up and checks out exactly once per job,
+    // so nobody can still be looking at this job when the next one is set up
+    const unsigned nw = (unsigned)_th.size();
+    tws_lwsem_release(&_wake, nw);
+    _work();
+    for(unsigned i = 0; i < nw; ++i)
+        tws_lwsem_acquire(&_checkout, 256);
+
+    _busy = false;
+}
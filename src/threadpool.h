@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+#include "tws_thread.h"
+
+// Simple fork-join pool on top of tws_thread.
+// The calling thread participates in the work, so a pool of size 1 has no extra threads.
+class ThreadPool
+{
+public:
+    typedef void (*Func)(void *ud, size_t i);
+
+    ThreadPool(unsigned nthreads = 0); // 0 = one thread per CPU core
+    ~ThreadPool();
+
+    unsigned size() const { return unsigned(_th.size() + 1); }
+
+    // Calls f(ud, i) for all i in [0, n) and blocks until all calls are done.
+    // If the pool is already busy (nested or concurrent use) everything runs serially on the calling thread.
+    void run(Func f, void *ud, size_t n);
+
+    template<typename F>
+    void forEach(size_t n, F& f)
+    {
+        run(&_call<F>, &f, n);
+    }
+
+private:
+    ThreadPool(const ThreadPool&); // non-copyable
+    ThreadPool& operator=(const ThreadPool&);
+
+    template<typename F>
+    static void _call(void *ud, size_t i)
+    {
+        (*static_cast<F*>(ud))(i);
+    }
+
+    static void _workerEntry(void *ud);
+    void _work();
+
+    std::vector<tws_Thread*> _th;
+    tws_LWsem _wake;
+    tws_LWsem _checkout;
+    std::atomic<bool> _busy;
+    std::atomic<size_t> _next;
+    Func _f;
+    void *_ud;
+    size_t _n;
+    bool _quit;
+};
+
+// Runs f(i) for all i in [0, n); serially on the calling thread if there is no pool
+template<typename F>
+void parallelFor(ThreadPool *pool, size_t n, F& f)
+{
+    if(pool && n > 1)
+        pool->forEach(n, f);
+    else
+        for(size_t i = 0; i < n; ++i)
+            f(i);
+}
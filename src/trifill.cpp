@@ -8,6 +8,7 @@
 #include "array2d.h"
 #include "polygon.h"
 #include "image2d.h"
+#include "orient.h"
 
 struct PointCollector
 {
@@ -84,7 +85,7 @@ size_t trifill(Array2d<unsigned char>& out, const uvec2 *points, const Tri *tris
     return filled;
 }
 
-static void drawtri(Image2d& out, ivec2 offset, uvec2 a, uvec2 b, uvec2 c, std::vector<uvec2>& pointsWrk, const Image2d& src)
+static void drawtri(Image2d& out, const AABB& clip, ivec2 offset, uvec2 a, uvec2 b, uvec2 c, std::vector<uvec2>& pointsWrk, const Image2d& src, unsigned orientation, uvec2 srcsize)
 {
     fillpoints(pointsWrk, a, b, c);
     const size_t N = pointsWrk.size();
@@ -99,45 +100,84 @@ static void drawtri(Image2d& out, ivec2 offset, uvec2 a, uvec2 b, uvec2 c, std::
         assert(!(i < N) || pointsWrk[i].y == start.y+1); // exactly one greater, can't have a gap
         // i is now at first point with greater y
 
-        const Pixel *psrc = src.row(start.y) + start.x;
-        Pixel *pdst = out.row(size_t(start.y) + offset.y) + start.x + offset.x; // cast to avoid warnings
-        const size_t len = size_t(end.x) - start.x + 1;
-        for(size_t x = 0; x < len; ++x)
-            if(psrc[x].a)
-                pdst[x] = psrc[x];
+        // clip in out's space, then go back to triangle space
+        const ptrdiff_t y = ptrdiff_t(start.y) + offset.y;
+        if(y < ptrdiff_t(clip.y1) || y > ptrdiff_t(clip.y2))
+            continue;
+        const ptrdiff_t x1 = std::max(ptrdiff_t(start.x) + offset.x, ptrdiff_t(clip.x1));
+        const ptrdiff_t x2 = std::min(ptrdiff_t(end.x) + offset.x, ptrdiff_t(clip.x2));
+        if(x1 > x2)
+            continue;
+        start.x = unsigned(x1 - offset.x);
+
+        Pixel *pdst = out.row(y) + x1;
+        const size_t len = size_t(x2 - x1) + 1;
+        if(!orientation)
+        {
+            const Pixel *psrc = src.row(start.y) + start.x;
+            for(size_t x = 0; x < len; ++x)
+                if(psrc[x].a)
+                    pdst[x] = psrc[x];
+        }
+        else
+        {
+            // Points are in oriented space, map each pixel back to where it came from
+            for(size_t x = 0; x < len; ++x)
+            {
+                const uvec2 s = unorientPoint(orientation, uvec2(unsigned(start.x + x), start.y), srcsize);
+                if(s.x < src.width() && s.y < src.height()) // may be in the padding
+                {
+                    const Pixel& p = src(s.x, s.y);
+                    if(p.a)
+                        pdst[x] = p;
+                }
+            }
+        }
     }
 }
 
 void tridraw(Image2d& out, ivec2 offset, const uvec2* points, const Tri* tris, size_t ntris, const Image2d& src)
+{
+    tridraw(out, offset, points, tris, ntris, src, ORIENT_NORMAL, uvec2());
+}
+
+void tridraw(Image2d& out, ivec2 offset, const uvec2* points, const Tri* tris, size_t ntris, const Image2d& src, unsigned orientation, uvec2 srcsize)
+{
+    const AABB all = { 0, 0, out.width() - 1, out.height() - 1 };
+    tridraw(out, all, offset, points, tris, ntris, src, orientation, srcsize);
+}
+
+void tridraw(Image2d& out, const AABB& clip, ivec2 offset, const uvec2* points, const Tri* tris, size_t ntris, const Image2d& src, unsigned orientation, uvec2 srcsize)
 {
     std::vector<uvec2> pointsWrk;
     pointsWrk.reserve(128); // guess
     for(size_t i = 0; i < ntris; ++i)
     {
         Tri t = tris[i];
-        drawtri(out, offset, points[t.a], points[t.b], points[t.c], pointsWrk, src);
+        drawtri(out, clip, offset, points[t.a], points[t.b], points[t.c], pointsWrk, src, orientation, srcsize);
     }
 }
 
-size_t downsample4x4(Array2d<unsigned char>& out, Array2d<unsigned char>& in)
+size_t downsampleBlocks(Array2d<unsigned char>& out, const Array2d<unsigned char>& in, unsigned bw, unsigned bh)
 {
-    assert(in.width() % 4 == 0 && in.height() % 4 == 0);
+    assert(in.width() % bw == 0 && in.height() % bh == 0);
     const size_t ww = out.width();
     const size_t hh = out.height();
-    assert(in.width() / 4 == ww && in.height() / 4 == hh);
+    assert(in.width() / bw == ww && in.height() / bh == hh);
 
-    unsigned char *pout = out.data();
     size_t used = 0;
-
     for(size_t yy = 0; yy < hh; ++yy)
         for(size_t xx = 0; xx < ww; ++xx)
         {
-            size_t blockused = 0;
-            for(size_t y = 0; y < 4; ++y)
-                for(size_t x = 0; x < 4; ++x)
-                    blockused += in(x+xx*4, y+yy*4);
-
-            out(xx, yy) = (unsigned char)blockused;
+            unsigned blockused = 0;
+            for(unsigned y = 0; y < bh; ++y)
+            {
+                const unsigned char * const p = in.row(yy * bh + y) + xx * bw;
+                for(unsigned x = 0; x < bw; ++x)
+                    blockused += !!p[x];
+            }
+
+            out(xx, yy) = (unsigned char)std::min(blockused, 255u);
             used += !!blockused;
         }
 
@@ -5,9 +5,17 @@
 #include "polygon.h"
 
 class Image2d;
+struct AABB;
 
 size_t trifill(Array2d<unsigned char>& out, const uvec2 *points, const Tri *tris, size_t ntris);
 void tridraw(Image2d& out, ivec2 offset, const uvec2 *points, const Tri *tris, size_t ntris, const Image2d& src);
-size_t downsample4x4(Array2d<unsigned char>& out, Array2d<unsigned char>& in);
+// points are given after applying orientation (see orient.h) to an area of srcsize, src is not oriented.
+void tridraw(Image2d& out, ivec2 offset, const uvec2 *points, const Tri *tris, size_t ntris, const Image2d& src, unsigned orientation, uvec2 srcsize);
+// Same, but only touches pixels of out in clip (inclusive). Useful to draw disjoint parts of out on different threads.
+void tridraw(Image2d& out, const AABB& clip, ivec2 offset, const uvec2 *points, const Tri *tris, size_t ntris, const Image2d& src, unsigned orientation, uvec2 srcsize);
+
+// Each cell of out gets the number of non-zero pixels in the corresponding bw x bh block of in (saturated to 255).
+// Returns the number of blocks that have any.
+size_t downsampleBlocks(Array2d<unsigned char>& out, const Array2d<unsigned char>& in, unsigned bw, unsigned bh);
 
 void triwireframe(Image2d& out, ivec2 offset, const uvec2 *points, const Tri *tris, size_t ntris, Pixel color);
@@ -1,4 +1,5 @@
 #include "util.h"
+#include <string.h>
 
 static bool issep(char x)
 {
@@ -26,3 +27,39 @@ std::string filename(const std::string & full)
     }
     return full;
 }
+
+static inline u64 rotl64(u64 x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 hashMix(u64 acc, u64 v)
+{
+    acc += v * 0xC2B2AE3D27D4EB4Full;
+    return rotl64(acc, 31) * 0x9E3779B185EBCA87ull;
+}
+
+u64 hashBytes(const void *data, size_t bytes, u64 seed)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    u64 lane[4] = { seed + 1, seed + 2, seed + 3, seed + 4 };
+    size_t i = 0;
+    for( ; i + 32 <= bytes; i += 32)
+        for(unsigned k = 0; k < 4; ++k)
+        {
+            u64 v;
+            memcpy(&v, p + i + k * 8, 8);
+            lane[k] = hashMix(lane[k], v);
+        }
+
+    u64 h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    for( ; i < bytes; ++i)
+        h = hashMix(h, p[i]);
+    h = hashMix(h, bytes);
+
+    // final avalanche
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
@@ -4,9 +4,11 @@
 
 #ifdef _MSC_VER
 typedef __int64 s64;
+typedef unsigned __int64 u64;
 #else
 #include <stdint.h>
 typedef int64_t s64;
+typedef uint64_t u64;
 #endif
 
 static const char DIRSEP =
@@ -37,3 +39,7 @@ inline unsigned nextPowerOf2(unsigned in)
 
 std::string dirname(const std::string& fn);
 std::string filename(const std::string& fn);
+
+// Fast non-cryptographic 64-bit hash. Runs 4 independent lanes over 32-byte chunks, so the compiler can vectorize it.
+// Chain calls by passing the previous result as seed.
+u64 hashBytes(const void *data, size_t bytes, u64 seed = 0);